@@ -0,0 +1,5 @@
+VER=`(cat VERSION)`
+MAJOR=`(cut -d . -f 1 VERSION)`
+MINOR=`(cut -d . -f 2 VERSION)`
+SO = so
+SOFLAGS = -shared -Wl,-soname,libderp.so.${MAJOR}.${MINOR}
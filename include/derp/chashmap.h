@@ -0,0 +1,29 @@
+#ifndef LIBDERP_CHASHMAP_H
+#define LIBDERP_CHASHMAP_H
+
+#include "derp/common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A hashmap that many threads may use at once. Lookups take no
+ * locks, writers lock only a stripe of the table, and removed
+ * entries are destroyed once no lookup can still be reading them.
+ *
+ * chm_at returns the value itself, which the map can't protect after
+ * the call returns. If other threads may remove or replace a key
+ * while you hold its value, don't give the map a val_dtor. */
+
+typedef struct chashmap chashmap;
+
+chashmap * chm_new(size_t, hashfn *, comparator *, void *cmp_aux);
+void       chm_free(chashmap *);
+void       chm_dtor(chashmap *, dtor *key_dtor, dtor *val_dtor, void *aux);
+size_t     chm_length(const chashmap *);
+bool       chm_is_empty(const chashmap *);
+void *     chm_at(chashmap *, const void *);
+bool       chm_insert(chashmap *, void *key, void *val);
+bool       chm_remove(chashmap *, void *);
+void       chm_clear(chashmap *);
+
+#endif
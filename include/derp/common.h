@@ -2,6 +2,7 @@
 #define LIBDERP_COMMON_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 struct map_pair
 {
@@ -12,12 +13,31 @@ struct map_pair
 typedef int comparator(const void *, const void *, void *aux);
 typedef unsigned long hashfn(const void *);
 typedef void dtor(void *, void *aux);
+/* given the current value (NULL if absent), returns the new one */
+typedef void *updater(void *val, void *aux);
 
 /* stdlib func wrappers that take (and ignore) aux param */
 
 dtor       derp_free;
 comparator derp_strcmp;
 
+/* hash functions for common key types, with matching comparators.
+ * They mix in a random per-process seed, so the hash of a given key
+ * can't be predicted from outside, or relied on between runs */
+
+hashfn     derp_hash_str;  /* NUL-terminated string */
+hashfn     derp_hash_u64;  /* pointer to uint64_t */
+comparator derp_u64cmp;
+hashfn     derp_hash_ptr;  /* the pointer itself, for identity maps */
+comparator derp_ptrcmp;
+
+/* The seed is picked on first use. Targets without /dev/urandom and
+ * a clock can only draw on addresses, so set one from a hardware RNG
+ * or the like with derp_hash_set_seed, before hashing anything */
+uint64_t   derp_hash_seed(void);
+void       derp_hash_set_seed(uint64_t);
+uint64_t   derp_hash_bytes(const void *, size_t len, uint64_t seed);
+
 /* if you want something other than malloc/realloc/free */
 
 void derp_use_alloc_funcs(
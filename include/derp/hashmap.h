@@ -2,7 +2,6 @@
 #define LIBDERP_HASHMAP_H
 
 #include "derp/common.h"
-#include "derp/list.h"
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -10,16 +9,56 @@
 typedef struct hashmap hashmap;
 typedef struct hm_iter hm_iter;
 
+/* declared here so iterators can live on the stack,
+ * but clients shouldn't look inside */
+struct hm_iter
+{
+	hashmap *h;
+	size_t slot;
+};
+
+#define HM_PROBE_HIST_LEN 16
+
+/* a snapshot of how well the hash function spreads keys */
+struct hm_stats
+{
+	size_t length;
+	size_t capacity;    /* slots, including a table still draining */
+	double load_factor;
+	size_t tombstones;
+	/* groups of slots a lookup visits before finding each entry,
+	 * probe_hist[i] counts entries found after visiting i+1 groups,
+	 * and the last element also collects the long tail */
+	size_t max_probe;
+	size_t probe_hist[HM_PROBE_HIST_LEN];
+	/* comparator calls per successful lookup, averaged over
+	 * every key, so 1.0 means no calls are wasted */
+	double cmps_per_hit;
+};
+
 hashmap * hm_new(size_t, hashfn *, comparator *, void *cmp_aux);
 void      hm_free(hashmap *);
 void      hm_dtor(hashmap *, dtor *key_dtor, dtor *val_dtor, void *aux);
 size_t    hm_length(const hashmap *);
 bool      hm_is_empty(const hashmap *);
+bool      hm_reserve(hashmap *, size_t);
+bool      hm_stats(const hashmap *, struct hm_stats *);
 void *    hm_at(const hashmap *, const void *);
 bool      hm_insert(hashmap *, void *key, void *val);
+/* Return the value slot for key, adding the key with a NULL value if
+ * it was missing. Only one lookup either way. The slot moves on the
+ * next insert or remove. If the key was already present, the map
+ * keeps its own key and the caller still owns the one passed in */
+void **   hm_get_or_insert(hashmap *, void *key, bool *inserted);
+bool      hm_update(hashmap *, void *key, updater *, void *aux);
+size_t    hm_at_many(const hashmap *, void *const keys[], size_t n,
+                     void *vals[]);
+size_t    hm_insert_many(hashmap *, void *const keys[],
+                         void *const vals[], size_t n);
 bool      hm_remove(hashmap *, void *);
 void      hm_clear(hashmap *);
 
+void             hm_iter_init(hm_iter *, hashmap *);
 hm_iter*         hm_iter_begin(hashmap *);
 struct map_pair* hm_iter_next(hm_iter *);
 void             hm_iter_free(hm_iter *);
@@ -0,0 +1,37 @@
+#ifndef LIBDERP_HM_FROZEN_H
+#define LIBDERP_HM_FROZEN_H
+
+#include "derp/hashmap.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A read-only snapshot of a hashmap, stored in a file that processes
+ * map into memory rather than rebuild. Keys are placed with a minimal
+ * perfect hash, so a lookup reads one displacement and one slot, then
+ * compares a single key.
+ *
+ * The file holds bytes, not pointers, so hm_freeze asks how to turn
+ * each key and value into bytes. The file uses the byte order of the
+ * machine that wrote it, and other machines refuse to open it. */
+
+typedef struct hm_frozen hm_frozen;
+
+/* point *bytes at the serialized form of x and return its length */
+typedef size_t hm_bytes(const void *x, const void **bytes, void *aux);
+
+/* C strings, without their terminator. NULL becomes "" */
+size_t hm_bytes_str(const void *s, const void **bytes, void *aux);
+
+/* NULL for either function means hm_bytes_str */
+bool        hm_freeze(hashmap *, const char *path,
+                      hm_bytes *key_bytes, hm_bytes *val_bytes, void *aux);
+hm_frozen * hm_frozen_open(const char *path);
+void        hm_frozen_close(hm_frozen *);
+size_t      hm_frozen_length(const hm_frozen *);
+/* Returned values point into the mapping, are followed by a NUL, and
+ * last until hm_frozen_close. vallen may be NULL */
+const void *hm_frozen_at(const hm_frozen *, const void *key, size_t keylen,
+                         size_t *vallen);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef LIBDERP_STR_H
+#define LIBDERP_STR_H
+
+#include "derp/common.h"
+
+#include <stddef.h>
+
+#define DERP_STR_INLINE 24
+
+/* A string key that knows its length and hash, so maps don't have to
+ * recompute either. Strings shorter than DERP_STR_INLINE are stored
+ * inline, longer ones point at their bytes.
+ *
+ * client may look inside, but should treat it as read-only */
+typedef struct derp_str
+{
+	size_t len;
+	unsigned long hash;
+	union
+	{
+		char buf[DERP_STR_INLINE];
+		const char *ptr;
+	} data;
+} derp_str;
+
+/* copies the bytes, free the result with derp_str_free */
+derp_str *   derp_str_new(const char *, size_t len);
+/* copies short strings, but only points at long ones, so a long s
+ * must outlive the derp_str. Handy for lookup keys on the stack */
+void         derp_str_init(derp_str *, const char *s, size_t len);
+const char * derp_str_data(const derp_str *);
+size_t       derp_str_len(const derp_str *);
+
+dtor         derp_str_free;
+hashfn       derp_str_hash;
+/* a total order, suitable for treemaps */
+comparator   derp_str_cmp;
+/* equality only, suitable for hashmaps. Mismatched lengths or
+ * hashes return nonzero without looking at the bytes */
+comparator   derp_str_eq;
+
+#endif
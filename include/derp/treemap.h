@@ -9,18 +9,116 @@
 typedef struct treemap treemap;
 typedef struct tm_iter tm_iter;
 
+/* the value for a key both maps hold, given the value in each */
+typedef void *tm_merger(void *dst_val, void *src_val, void *aux);
+
+/* An AA tree of n nodes is at most 2*log2(n+1) deep,
+ * so this covers any tree that fits in memory */
+#define TM_ITER_MAX_DEPTH 128
+
+/* declared here so iterators can live on the stack,
+ * but clients shouldn't look inside */
+struct tm_iter
+{
+	/* path from the root to the node beside the cursor, and which
+	 * side of it the cursor is on. With no path, the cursor is
+	 * before everything or, if after is set, past everything */
+	struct tm_node *stack[TM_ITER_MAX_DEPTH];
+	size_t depth;
+	bool after;
+	/* for B+ trees */
+	struct bt_leaf *leaf;
+	size_t pos;
+	const treemap *t;
+	/* for ranges */
+	const void *start, *end;
+};
+
 treemap * tm_new(comparator *, void *cmp_aux);
+/* Same interface, with pairs packed into B+ tree nodes for fewer
+ * cache misses on big trees. Pairs move as the tree changes, so
+ * pointers from tm_get_or_insert or iterators only last until the
+ * next insert or remove */
+treemap * tm_new_btree(comparator *, void *cmp_aux);
+/* Build a balanced tree from pairs in strictly ascending key order,
+ * in linear time and without calling the comparator */
+treemap * tm_from_sorted(const struct map_pair *, size_t n,
+                         comparator *, void *cmp_aux);
+/* A read-only view of the tree as it is now, in constant time. Later
+ * changes to the tree copy the nodes they touch rather than disturb
+ * the snapshot, which shares the rest. Writes to a snapshot fail.
+ *
+ * Take snapshots on the thread that writes the tree, then hand them
+ * to readers, which need no locks. Readers may free their snapshots
+ * on any thread. That takes the GCC/Clang atomic builtins; built
+ * without them, keep a tree and its snapshots on one thread.
+ *
+ * Snapshots share keys and values without owning them. The tree's
+ * destructors run on a pair it lets go of only once no snapshot can
+ * see it: on the tree's first write after its snapshots are all
+ * freed, or if the tree was freed first, when the last snapshot is.
+ * Until then a tm_clear that would need to hold on to pairs can run
+ * out of memory, leaving the tree as it was. NULL for B+ trees, or
+ * if out of memory */
+treemap * tm_snapshot(const treemap *);
 void      tm_free(treemap *);
 void      tm_dtor(treemap *, dtor *key_dtor, dtor *val_dtor, void *aux);
 size_t    tm_length(const treemap *);
 bool      tm_is_empty(const treemap *);
 void *    tm_at(const treemap *, const void *);
 bool      tm_insert(treemap *, void *key, void *val);
+/* tm_insert for each of pairs, which must be in strictly ascending
+ * key order. Merges them with the tree in linear time and rebuilds it
+ * when that's cheaper than inserting one at a time. False if out of
+ * memory, leaving the tree as it was, except that a B+ tree taking
+ * a few pairs one at a time keeps those inserted so far */
+bool      tm_insert_sorted(treemap *, const struct map_pair *, size_t n);
+/* like hm_get_or_insert, a NULL placeholder for missing keys */
+void **   tm_get_or_insert(treemap *, void *key, bool *inserted);
+bool      tm_update(treemap *, void *key, updater *, void *aux);
 bool      tm_remove(treemap *, void *);
+/* how many keys are less than key, whether or not key is present */
+size_t    tm_rank(const treemap *, const void *key);
+/* the pair with i keys before it, NULL when i >= tm_length */
+struct map_pair* tm_select(const treemap *, size_t i);
+/* the first pair with key >= the given key, and with key > it */
+struct map_pair* tm_lower_bound(const treemap *, const void *key);
+struct map_pair* tm_upper_bound(const treemap *, const void *key);
+/* the pair with the greatest key <= the given key,
+ * and with the least key >= it (same as tm_lower_bound) */
+struct map_pair* tm_floor(const treemap *, const void *key);
+struct map_pair* tm_ceiling(const treemap *, const void *key);
+/* the pairs with the least and greatest keys in constant time, NULL
+ * when empty */
+struct map_pair* tm_first(const treemap *);
+struct map_pair* tm_last(const treemap *);
 void      tm_clear(treemap *);
 
+/* Combine src into dst in time linear in their lengths, for maps
+ * ordered the same way. dst keeps its keys, and where both have a key
+ * fn picks the value, or NULL keeps dst's. Pairs dst drops go through
+ * its destructors, and pairs it gains from src are shared with src,
+ * not copied. False if out of memory, leaving dst as it was */
+bool      tm_union(treemap *dst, const treemap *src, tm_merger *, void *aux);
+bool      tm_intersection(treemap *dst, const treemap *src,
+                          tm_merger *, void *aux);
+bool      tm_difference(treemap *dst, const treemap *src);
+
+/* An iterator is a cursor between two pairs. tm_iter_next returns
+ * the pair after it and moves past, tm_iter_prev the pair before,
+ * and both return NULL at the end, leaving the cursor in place. Each
+ * step takes amortized constant time */
+
+/* start before the first pair, or after the last for walking back */
+void             tm_iter_init(tm_iter *, treemap *);
+void             tm_iter_init_end(tm_iter *, treemap *);
+/* iterate over keys from <= k < to, starting at from. NULL for
+ * either bound leaves that end open */
+void             tm_iter_range(tm_iter *, treemap *,
+                               const void *from, const void *to);
 tm_iter*         tm_iter_begin(treemap *);
 struct map_pair* tm_iter_next(tm_iter *);
+struct map_pair* tm_iter_prev(tm_iter *);
 void             tm_iter_free(tm_iter *);
 
 #endif
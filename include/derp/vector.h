@@ -5,10 +5,19 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct vector vector;
 
 vector * v_new(void);
+/* A vector of elt_size-byte values stored inline rather than of
+ * pointers. Functions taking an element copy elt_size bytes from the
+ * pointer given (or zeros for NULL). Functions returning one return
+ * a pointer into the vector, good until the next change to it, except
+ * for the v_remove family, whose result points to a copy that lasts
+ * until the next removal. Comparators and destructors get pointers to
+ * the elements */
+vector * v_new_sized(size_t elt_size);
 void     v_free(vector *);
 void     v_dtor(vector *, dtor *, void *);
 size_t   v_length(const vector *);
@@ -19,6 +28,9 @@ bool     v_is_empty(const vector *);
 void *   v_at(const vector *, size_t);
 void *   v_first(const vector *);
 void *   v_last(const vector *);
+/* Either end takes amortized constant time, so a vector serves as a
+ * queue or deque. Inserting or removing elsewhere moves the elements
+ * on whichever side is shorter */
 bool     v_append(vector *, void *);
 bool     v_prepend(vector *, void *);
 void *   v_remove_first(vector *);
@@ -32,6 +44,22 @@ size_t   v_find_index(const vector *, const void *,
 size_t   v_find_last_index(const vector *, const void *,
                            comparator *, void *aux);
 bool     v_sort(vector *, comparator *, void *aux);
+/* v_sort spread over nthreads threads, or one per online processor
+ * when nthreads is 0. Vectors too small to be worth it get v_sort.
+ * The comparator is called from all the threads at once */
+bool     v_sort_parallel(vector *, comparator *, void *aux,
+                         unsigned nthreads);
 bool     v_reverse(vector *);
 
+/* Sort key for an element, as an unsigned number. Shorter keys fit as
+ * they are; signed ones need their sign bit flipped, and byte strings
+ * can sort by their first eight bytes, most significant first */
+typedef uint64_t v_radix_key(const void *elt, void *aux);
+
+/* Stable sort by key in linear time, with no comparisons. False if
+ * out of memory, leaving the vector as it was */
+bool     v_radix_sort(vector *, v_radix_key *, void *aux);
+/* key of a C string's first eight bytes, for v_radix_sort */
+uint64_t v_radix_str_prefix(const void *s, void *aux);
+
 #endif
@@ -0,0 +1,22 @@
+#ifndef DERP_ATOMIC_H
+#define DERP_ATOMIC_H
+
+/* C99 has no atomics, so use the builtins that GCC and Clang share.
+ * Everything is sequentially consistent, which is what the lock-free
+ * code relies on when it reasons about orderings. */
+
+#if !defined(__GNUC__)
+	#error "atomic operations need GCC or Clang builtins"
+#endif
+
+#define ATOMIC_LOAD(p)         __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE(p, v)     __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_FETCH_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_FETCH_SUB(p, v) __atomic_fetch_sub((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_EXCHANGE(p, v)  __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+/* on failure, *expected gets the current value */
+#define ATOMIC_CAS(p, expected, desired) \
+	__atomic_compare_exchange_n((p), (expected), (desired), 0, \
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
+#endif
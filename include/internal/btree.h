@@ -0,0 +1,58 @@
+#ifndef DERP_BTREE_H
+#define DERP_BTREE_H
+
+#include "derp/common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* B+ tree storage behind tm_new_btree. The treemap keeps the dtors
+ * and runs them; these functions only move pairs around. */
+
+struct btree;
+struct bt_leaf;
+
+struct btree *   internal_bt_new(comparator *, void *cmp_aux);
+void             internal_bt_free(struct btree *,
+                                  dtor *key_dtor, dtor *val_dtor, void *aux);
+void             internal_bt_clear(struct btree *,
+                                   dtor *key_dtor, dtor *val_dtor, void *aux);
+size_t           internal_bt_length(const struct btree *);
+struct map_pair *internal_bt_find(const struct btree *, const void *key);
+/* Find key, or add it with a NULL value. When found and old_key is
+ * not NULL, the tree adopts the new key pointer and hands back the
+ * one it held. NULL if out of memory */
+struct map_pair *internal_bt_insert(struct btree *, void *key,
+                                    bool *found, void **old_key);
+bool             internal_bt_remove(struct btree *, const void *key,
+                                    struct map_pair *removed);
+/* keys less than key, and the pair with i keys less than it */
+size_t           internal_bt_rank(const struct btree *, const void *key);
+struct map_pair *internal_bt_select(const struct btree *, size_t i);
+
+/* Replace the tree's contents with up to max_pairs pairs, added in
+ * strictly ascending key order. begin returns NULL if out of memory,
+ * leaving the tree alone. Until end, the tree's own pairs can still
+ * be read, and add returns where the pair landed. end frees the old
+ * nodes without running destructors on their pairs */
+struct bt_build;
+struct bt_build *internal_bt_build_begin(struct btree *, size_t max_pairs);
+struct map_pair *internal_bt_build_add(struct bt_build *, struct map_pair);
+void             internal_bt_build_end(struct bt_build *);
+
+/* A cursor is a leaf and a position between two of its pairs. next
+ * returns the pair after the cursor and moves past it, prev the one
+ * before, crossing into neighbouring leaves as needed. At either end
+ * they return NULL and leave the cursor be */
+struct bt_leaf * internal_bt_first(const struct btree *);
+/* put the cursor after the last key */
+void             internal_bt_last(const struct btree *,
+                                  struct bt_leaf **, size_t *pos);
+/* put the cursor before the first key >= key, or > key if strictly */
+void             internal_bt_seek(const struct btree *, const void *key,
+                                  bool strictly,
+                                  struct bt_leaf **, size_t *pos);
+struct map_pair *internal_bt_next(struct bt_leaf **, size_t *pos);
+struct map_pair *internal_bt_prev(struct bt_leaf **, size_t *pos);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef DERP_VECTOR_H
+#define DERP_VECTOR_H
+
+#include "derp/vector.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Vector internals shared with v_parallel.c, which is kept apart
+ * from vector.c because it needs POSIX threads. */
+
+/* Vectors from v_new hold void pointers. Those from v_new_sized hold
+ * the elements themselves, elt_size bytes apiece, and pass pointers to
+ * them wherever the others pass the pointers they hold. */
+struct vector
+{
+	size_t length;
+	size_t capacity;
+	size_t elt_size;
+	bool by_value;
+	size_t head; /* slot holding element 0 */
+	char *elts;
+	void *removed; /* for by_value, a copy of the last one removed */
+	dtor *elt_dtor;
+	void *dtor_aux;
+};
+
+/* A range of elements to sort in place, starting at elts, which is
+ * the vector's array or a copy of it */
+struct v_sort
+{
+	vector *v;
+	char *elts;
+	bool by_value;
+	comparator *cmp;
+	void *aux;
+};
+
+/* Put element 0 at the start of the array */
+void internal_v_unwrap(vector *);
+/* sort the n elements from lo */
+void internal_v_sort_range(const struct v_sort *, size_t lo, size_t n);
+
+#endif
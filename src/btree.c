@@ -0,0 +1,802 @@
+#include <assert.h>
+#include <string.h>
+
+#include "internal/alloc.h"
+#include "internal/btree.h"
+
+/* B+ tree:
+ * Pairs live only in the leaves, which link to their neighbours so
+ * scans never climb back up. Inner nodes hold separator keys, each
+ * the smallest key of the subtree to its right, so a separator
+ * always points at a live key and changes when that key leaves.
+ *
+ * Inserts split full nodes and removes refill thin ones on the way
+ * down, so neither has to climb back up to rebalance. Inner nodes
+ * also count the pairs below each child, for rank and select. */
+
+#define LEAF_MAX  32
+#define LEAF_MIN  (LEAF_MAX / 2)
+#define INNER_MAX 32
+#define INNER_MIN ((INNER_MAX - 1) / 2)
+/* a root and a chain of inner nodes, each with at least INNER_MIN+1
+ * children, can't get this deep before memory runs out */
+#define MAX_DEPTH 32
+
+struct bt_node
+{
+	unsigned count; /* pairs in a leaf, separators in an inner node */
+	bool leaf;
+};
+
+struct bt_leaf
+{
+	struct bt_node hdr;
+	struct bt_leaf *prev, *next;
+	struct map_pair pairs[LEAF_MAX];
+};
+
+struct bt_inner
+{
+	struct bt_node hdr;
+	void *keys[INNER_MAX];
+	struct bt_node *kids[INNER_MAX + 1];
+	size_t sizes[INNER_MAX + 1]; /* pairs under each kid */
+};
+
+struct btree
+{
+	struct bt_node *root; /* never NULL, an empty tree is one leaf */
+	struct bt_leaf *first, *last; /* the ends of the leaf list */
+	size_t length;
+	comparator *cmp;
+	void *cmp_aux;
+};
+
+static struct bt_leaf *
+internal_bt_new_leaf(void)
+{
+	struct bt_leaf *l = internal_malloc(sizeof *l);
+	if (l)
+		*l = (struct bt_leaf){.hdr = {.leaf = true}};
+	return l;
+}
+
+struct btree *
+internal_bt_new(comparator *cmp, void *cmp_aux)
+{
+	struct btree *bt = internal_malloc(sizeof *bt);
+	struct bt_leaf *root = internal_bt_new_leaf();
+	if (!bt || !root)
+	{
+		internal_free(bt);
+		internal_free(root);
+		return NULL;
+	}
+	*bt = (struct btree){
+		.root = &root->hdr, .first = root, .last = root,
+		.cmp = cmp, .cmp_aux = cmp_aux
+	};
+	return bt;
+}
+
+/* free n and everything below it except keep, which must be the
+ * leftmost leaf if it's anywhere in there */
+static void
+internal_bt_free_node(struct bt_node *n, struct bt_leaf *keep,
+                      dtor *key_dtor, dtor *val_dtor, void *aux)
+{
+	if (n->leaf)
+	{
+		struct bt_leaf *l = (struct bt_leaf *)n;
+		for (unsigned i = 0; i < n->count; i++)
+		{
+			if (key_dtor)
+				key_dtor(l->pairs[i].k, aux);
+			if (val_dtor)
+				val_dtor(l->pairs[i].v, aux);
+		}
+		if (l == keep)
+			*l = (struct bt_leaf){.hdr = {.leaf = true}};
+		else
+			internal_free(l);
+		return;
+	}
+	struct bt_inner *in = (struct bt_inner *)n;
+	for (unsigned i = 0; i <= n->count; i++)
+		internal_bt_free_node(in->kids[i], keep, key_dtor, val_dtor, aux);
+	internal_free(in);
+}
+
+void
+internal_bt_clear(struct btree *bt,
+                  dtor *key_dtor, dtor *val_dtor, void *aux)
+{
+	/* hold on to one leaf, so clearing can't fail for want of one */
+	struct bt_leaf *keep = bt->first;
+	internal_bt_free_node(bt->root, keep, key_dtor, val_dtor, aux);
+	bt->root = &keep->hdr;
+	bt->last = keep;
+	bt->length = 0;
+}
+
+void
+internal_bt_free(struct btree *bt,
+                 dtor *key_dtor, dtor *val_dtor, void *aux)
+{
+	if (!bt)
+		return;
+	internal_bt_clear(bt, key_dtor, val_dtor, aux);
+	internal_free(bt->root);
+	internal_free(bt);
+}
+
+size_t
+internal_bt_length(const struct btree *bt)
+{
+	return bt->length;
+}
+
+/* position of key in the leaf, or where it would go */
+static size_t
+internal_bt_leaf_search(const struct btree *bt, const struct bt_leaf *l,
+                        const void *key, bool *eq)
+{
+	size_t lo = 0, hi = l->hdr.count;
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		int x = bt->cmp(key, l->pairs[mid].k, bt->cmp_aux);
+		if (x == 0)
+		{
+			*eq = true;
+			return mid;
+		}
+		if (x < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	*eq = false;
+	return lo;
+}
+
+/* which child covers key, i.e. how many separators are <= key.
+ * eq says whether the separator left of that child equals key */
+static size_t
+internal_bt_inner_search(const struct btree *bt, const struct bt_inner *in,
+                         const void *key, bool *eq)
+{
+	size_t lo = 0, hi = in->hdr.count;
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		int x = bt->cmp(key, in->keys[mid], bt->cmp_aux);
+		if (x == 0)
+		{
+			*eq = true;
+			return mid + 1;
+		}
+		if (x < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	*eq = false;
+	return lo;
+}
+
+struct map_pair *
+internal_bt_find(const struct btree *bt, const void *key)
+{
+	const struct bt_node *n = bt->root;
+	bool eq = false;
+	while (!n->leaf)
+	{
+		const struct bt_inner *in = (const struct bt_inner *)n;
+		if (eq) /* key is the smallest in this subtree */
+			n = in->kids[0];
+		else
+			n = in->kids[internal_bt_inner_search(bt, in, key, &eq)];
+	}
+	struct bt_leaf *l = (struct bt_leaf *)n;
+	size_t i = eq ? 0 : internal_bt_leaf_search(bt, l, key, &eq);
+	return eq ? &l->pairs[i] : NULL;
+}
+
+/* pairs under n */
+static size_t
+internal_bt_size(const struct bt_node *n)
+{
+	if (n->leaf)
+		return n->count;
+	const struct bt_inner *in = (const struct bt_inner *)n;
+	size_t total = 0;
+	for (unsigned i = 0; i <= n->count; i++)
+		total += in->sizes[i];
+	return total;
+}
+
+static bool
+internal_bt_full(const struct bt_node *n)
+{
+	return n->count == (n->leaf ? LEAF_MAX : INNER_MAX);
+}
+
+/* split the full child i of in, which has room for one more key */
+static bool
+internal_bt_split_child(struct btree *bt, struct bt_inner *in, size_t i)
+{
+	struct bt_node *child = in->kids[i], *right;
+	void *sep;
+	if (child->leaf)
+	{
+		struct bt_leaf *l = (struct bt_leaf *)child,
+		               *r = internal_malloc(sizeof *r);
+		if (!r)
+			return false;
+		r->hdr = (struct bt_node){.count = LEAF_MAX - LEAF_MIN, .leaf = true};
+		memcpy(r->pairs, l->pairs + LEAF_MIN, r->hdr.count * sizeof *r->pairs);
+		l->hdr.count = LEAF_MIN;
+		r->prev = l;
+		r->next = l->next;
+		if (l->next)
+			l->next->prev = r;
+		else
+			bt->last = r;
+		l->next = r;
+		sep = r->pairs[0].k;
+		right = &r->hdr;
+	}
+	else
+	{
+		/* the middle separator moves up rather than being copied */
+		size_t mid = INNER_MAX / 2;
+		struct bt_inner *c = (struct bt_inner *)child,
+		                *r = internal_malloc(sizeof *r);
+		if (!r)
+			return false;
+		r->hdr = (struct bt_node){.count = INNER_MAX - mid - 1};
+		memcpy(r->keys, c->keys + mid + 1, r->hdr.count * sizeof *r->keys);
+		memcpy(r->kids, c->kids + mid + 1,
+		       (r->hdr.count + 1) * sizeof *r->kids);
+		memcpy(r->sizes, c->sizes + mid + 1,
+		       (r->hdr.count + 1) * sizeof *r->sizes);
+		sep = c->keys[mid];
+		c->hdr.count = mid;
+		right = &r->hdr;
+	}
+	memmove(in->keys + i + 1, in->keys + i,
+	        (in->hdr.count - i) * sizeof *in->keys);
+	memmove(in->kids + i + 2, in->kids + i + 1,
+	        (in->hdr.count - i) * sizeof *in->kids);
+	memmove(in->sizes + i + 2, in->sizes + i + 1,
+	        (in->hdr.count - i) * sizeof *in->sizes);
+	in->keys[i] = sep;
+	in->kids[i+1] = right;
+	in->sizes[i+1] = internal_bt_size(right);
+	in->sizes[i] -= in->sizes[i+1];
+	in->hdr.count++;
+	return true;
+}
+
+struct map_pair *
+internal_bt_insert(struct btree *bt, void *key, bool *found, void **old_key)
+{
+	if (internal_bt_full(bt->root))
+	{
+		struct bt_inner *r = internal_malloc(sizeof *r);
+		if (!r)
+			return NULL;
+		r->hdr = (struct bt_node){.count = 0};
+		r->kids[0] = bt->root;
+		r->sizes[0] = bt->length;
+		if (!internal_bt_split_child(bt, r, 0))
+		{
+			internal_free(r);
+			return NULL;
+		}
+		bt->root = &r->hdr;
+	}
+
+	/* the one separator equal to key, which must follow any rekey */
+	void **sep = NULL;
+	struct bt_inner *path[MAX_DEPTH];
+	size_t at[MAX_DEPTH], depth = 0;
+	struct bt_node *n = bt->root;
+	bool eq;
+	while (!n->leaf)
+	{
+		struct bt_inner *in = (struct bt_inner *)n;
+		size_t i = internal_bt_inner_search(bt, in, key, &eq);
+		if (internal_bt_full(in->kids[i]))
+		{
+			if (!internal_bt_split_child(bt, in, i))
+				return NULL;
+			/* only the new separator needs checking */
+			int x = bt->cmp(key, in->keys[i], bt->cmp_aux);
+			if (x >= 0)
+			{
+				eq = x == 0;
+				i++;
+			}
+		}
+		if (eq)
+			sep = &in->keys[i-1];
+		assert(depth < MAX_DEPTH);
+		path[depth] = in;
+		at[depth++] = i;
+		n = in->kids[i];
+	}
+
+	struct bt_leaf *l = (struct bt_leaf *)n;
+	size_t i = internal_bt_leaf_search(bt, l, key, &eq);
+	*found = eq;
+	if (eq)
+	{
+		if (old_key)
+		{
+			*old_key = l->pairs[i].k;
+			l->pairs[i].k = key;
+			if (sep)
+				*sep = key;
+		}
+		return &l->pairs[i];
+	}
+	memmove(l->pairs + i + 1, l->pairs + i,
+	        (l->hdr.count - i) * sizeof *l->pairs);
+	l->pairs[i] = (struct map_pair){.k = key};
+	l->hdr.count++;
+	bt->length++;
+	while (depth-- > 0)
+		path[depth]->sizes[at[depth]]++;
+	return &l->pairs[i];
+}
+
+/* move the last entry of child i-1 to the front of child i */
+static void
+internal_bt_borrow_left(struct bt_inner *in, size_t i)
+{
+	struct bt_node *c = in->kids[i], *left = in->kids[i-1];
+	if (c->leaf)
+	{
+		struct bt_leaf *cl = (struct bt_leaf *)c,
+		               *ll = (struct bt_leaf *)left;
+		memmove(cl->pairs + 1, cl->pairs, c->count * sizeof *cl->pairs);
+		cl->pairs[0] = ll->pairs[left->count - 1];
+		in->keys[i-1] = cl->pairs[0].k;
+		in->sizes[i-1]--;
+		in->sizes[i]++;
+	}
+	else
+	{
+		struct bt_inner *ci = (struct bt_inner *)c,
+		                *li = (struct bt_inner *)left;
+		memmove(ci->keys + 1, ci->keys, c->count * sizeof *ci->keys);
+		memmove(ci->kids + 1, ci->kids, (c->count + 1) * sizeof *ci->kids);
+		memmove(ci->sizes + 1, ci->sizes,
+		        (c->count + 1) * sizeof *ci->sizes);
+		ci->keys[0] = in->keys[i-1];
+		ci->kids[0] = li->kids[left->count];
+		ci->sizes[0] = li->sizes[left->count];
+		in->keys[i-1] = li->keys[left->count - 1];
+		in->sizes[i-1] -= ci->sizes[0];
+		in->sizes[i] += ci->sizes[0];
+	}
+	left->count--;
+	c->count++;
+}
+
+/* move the first entry of child i+1 to the end of child i */
+static void
+internal_bt_borrow_right(struct bt_inner *in, size_t i)
+{
+	struct bt_node *c = in->kids[i], *right = in->kids[i+1];
+	if (c->leaf)
+	{
+		struct bt_leaf *cl = (struct bt_leaf *)c,
+		               *rl = (struct bt_leaf *)right;
+		cl->pairs[c->count] = rl->pairs[0];
+		memmove(rl->pairs, rl->pairs + 1,
+		        (right->count - 1) * sizeof *rl->pairs);
+		in->keys[i] = rl->pairs[0].k;
+		in->sizes[i]++;
+		in->sizes[i+1]--;
+	}
+	else
+	{
+		struct bt_inner *ci = (struct bt_inner *)c,
+		                *ri = (struct bt_inner *)right;
+		ci->keys[c->count] = in->keys[i];
+		ci->kids[c->count + 1] = ri->kids[0];
+		ci->sizes[c->count + 1] = ri->sizes[0];
+		in->keys[i] = ri->keys[0];
+		in->sizes[i] += ri->sizes[0];
+		in->sizes[i+1] -= ri->sizes[0];
+		memmove(ri->keys, ri->keys + 1,
+		        (right->count - 1) * sizeof *ri->keys);
+		memmove(ri->kids, ri->kids + 1, right->count * sizeof *ri->kids);
+		memmove(ri->sizes, ri->sizes + 1,
+		        right->count * sizeof *ri->sizes);
+	}
+	right->count--;
+	c->count++;
+}
+
+/* fold child i+1 into child i */
+static void
+internal_bt_merge(struct btree *bt, struct bt_inner *in, size_t i)
+{
+	struct bt_node *c = in->kids[i], *right = in->kids[i+1];
+	if (c->leaf)
+	{
+		struct bt_leaf *cl = (struct bt_leaf *)c,
+		               *rl = (struct bt_leaf *)right;
+		memcpy(cl->pairs + c->count, rl->pairs,
+		       right->count * sizeof *rl->pairs);
+		cl->next = rl->next;
+		if (rl->next)
+			rl->next->prev = cl;
+		else
+			bt->last = cl;
+	}
+	else
+	{
+		/* the separator between them comes down */
+		struct bt_inner *ci = (struct bt_inner *)c,
+		                *ri = (struct bt_inner *)right;
+		ci->keys[c->count] = in->keys[i];
+		memcpy(ci->keys + c->count + 1, ri->keys,
+		       right->count * sizeof *ri->keys);
+		memcpy(ci->kids + c->count + 1, ri->kids,
+		       (right->count + 1) * sizeof *ri->kids);
+		memcpy(ci->sizes + c->count + 1, ri->sizes,
+		       (right->count + 1) * sizeof *ri->sizes);
+		c->count++;
+	}
+	c->count += right->count;
+	internal_free(right);
+	memmove(in->keys + i, in->keys + i + 1,
+	        (in->hdr.count - i - 1) * sizeof *in->keys);
+	memmove(in->kids + i + 1, in->kids + i + 2,
+	        (in->hdr.count - i - 1) * sizeof *in->kids);
+	in->sizes[i] += in->sizes[i+1];
+	memmove(in->sizes + i + 1, in->sizes + i + 2,
+	        (in->hdr.count - i - 1) * sizeof *in->sizes);
+	in->hdr.count--;
+}
+
+/* give child i of in more than the minimum, so it can lose one */
+static void
+internal_bt_refill(struct btree *bt, struct bt_inner *in, size_t i)
+{
+	unsigned min = in->kids[i]->leaf ? LEAF_MIN : INNER_MIN;
+	if (i > 0 && in->kids[i-1]->count > min)
+		internal_bt_borrow_left(in, i);
+	else if (i < in->hdr.count && in->kids[i+1]->count > min)
+		internal_bt_borrow_right(in, i);
+	else if (i > 0)
+		internal_bt_merge(bt, in, i-1);
+	else
+		internal_bt_merge(bt, in, i);
+}
+
+bool
+internal_bt_remove(struct btree *bt, const void *key,
+                   struct map_pair *removed)
+{
+	void **sep = NULL;
+	struct bt_inner *path[MAX_DEPTH];
+	size_t at[MAX_DEPTH], depth = 0;
+	struct bt_node *n = bt->root;
+	bool eq;
+	while (!n->leaf)
+	{
+		struct bt_inner *in = (struct bt_inner *)n;
+		size_t i = internal_bt_inner_search(bt, in, key, &eq);
+		struct bt_node *c = in->kids[i];
+		if (c->count <= (c->leaf ? LEAF_MIN : INNER_MIN))
+		{
+			internal_bt_refill(bt, in, i);
+			if (in->hdr.count == 0)
+			{
+				/* the root's last two children merged */
+				assert(n == bt->root);
+				bt->root = n = in->kids[0];
+				internal_free(in);
+				continue;
+			}
+			i = internal_bt_inner_search(bt, in, key, &eq);
+		}
+		if (eq)
+			sep = &in->keys[i-1];
+		assert(depth < MAX_DEPTH);
+		path[depth] = in;
+		at[depth++] = i;
+		n = in->kids[i];
+	}
+
+	struct bt_leaf *l = (struct bt_leaf *)n;
+	size_t i = internal_bt_leaf_search(bt, l, key, &eq);
+	if (!eq)
+		return false;
+	while (depth-- > 0)
+		path[depth]->sizes[at[depth]]--;
+	if (removed)
+		*removed = l->pairs[i];
+	memmove(l->pairs + i, l->pairs + i + 1,
+	        (l->hdr.count - i - 1) * sizeof *l->pairs);
+	l->hdr.count--;
+	bt->length--;
+	if (sep)
+	{
+		/* key was the smallest of a subtree, and its successor
+		 * is now. The refill above left this leaf nonempty */
+		assert(i == 0 && l->hdr.count > 0);
+		*sep = l->pairs[0].k;
+	}
+	return true;
+}
+
+size_t
+internal_bt_rank(const struct btree *bt, const void *key)
+{
+	const struct bt_node *n = bt->root;
+	size_t rank = 0;
+	bool eq;
+	while (!n->leaf)
+	{
+		const struct bt_inner *in = (const struct bt_inner *)n;
+		size_t i = internal_bt_inner_search(bt, in, key, &eq);
+		for (size_t k = 0; k < i; k++)
+			rank += in->sizes[k];
+		if (eq) /* key is the smallest under kid i */
+			return rank;
+		n = in->kids[i];
+	}
+	return rank + internal_bt_leaf_search(
+		bt, (const struct bt_leaf *)n, key, &eq);
+}
+
+struct map_pair *
+internal_bt_select(const struct btree *bt, size_t i)
+{
+	if (i >= bt->length)
+		return NULL;
+	const struct bt_node *n = bt->root;
+	while (!n->leaf)
+	{
+		const struct bt_inner *in = (const struct bt_inner *)n;
+		size_t k = 0;
+		while (i >= in->sizes[k])
+			i -= in->sizes[k++];
+		n = in->kids[k];
+	}
+	return &((struct bt_leaf *)n)->pairs[i];
+}
+
+/* Bulk loading fills fresh leaves left to right, evens out the last
+ * two, and stacks inner levels on them with their children spread
+ * evenly, then frees the old nodes (but not their pairs). Everything
+ * the largest possible tree needs is allocated up front, so once a
+ * build begins it can't fail. */
+
+struct bt_build
+{
+	struct btree *bt;
+	struct bt_leaf *spare_leaves, *first, *last;
+	struct bt_inner *spare_inners;
+	/* for stacking the levels */
+	struct bt_node **level;
+	void **mins;
+	size_t *sizes, length;
+};
+
+static size_t
+internal_bt_div_up(size_t n, size_t d)
+{
+	return n / d + (n % d != 0);
+}
+
+static void
+internal_bt_build_free(struct bt_build *b)
+{
+	struct bt_leaf *l;
+	struct bt_inner *in;
+	while ((l = b->spare_leaves))
+	{
+		b->spare_leaves = l->next;
+		internal_free(l);
+	}
+	while ((in = b->spare_inners))
+	{
+		b->spare_inners = (struct bt_inner *)in->kids[0];
+		internal_free(in);
+	}
+	internal_free(b->level);
+	internal_free(b->mins);
+	internal_free(b->sizes);
+	internal_free(b);
+}
+
+struct bt_build *
+internal_bt_build_begin(struct btree *bt, size_t max_pairs)
+{
+	size_t leaves = max_pairs > 0 ? internal_bt_div_up(max_pairs, LEAF_MAX) : 1,
+	       inners = 0;
+	for (size_t c = leaves; c > 1; inners += c)
+		c = internal_bt_div_up(c, INNER_MAX + 1);
+	struct bt_build *b = internal_malloc(sizeof *b);
+	if (!b)
+		return NULL;
+	*b = (struct bt_build){
+		.bt = bt,
+		.level = internal_malloc(leaves * sizeof *b->level),
+		.mins  = internal_malloc(leaves * sizeof *b->mins),
+		.sizes = internal_malloc(leaves * sizeof *b->sizes)
+	};
+	bool ok = b->level && b->mins && b->sizes;
+	for (; ok && leaves > 0; leaves--)
+	{
+		struct bt_leaf *l = internal_bt_new_leaf();
+		if ((ok = l))
+		{
+			l->next = b->spare_leaves;
+			b->spare_leaves = l;
+		}
+	}
+	for (; ok && inners > 0; inners--)
+	{
+		struct bt_inner *in = internal_malloc(sizeof *in);
+		if ((ok = in))
+		{
+			in->kids[0] = (struct bt_node *)b->spare_inners;
+			b->spare_inners = in;
+		}
+	}
+	if (!ok)
+	{
+		internal_bt_build_free(b);
+		return NULL;
+	}
+	return b;
+}
+
+static struct bt_leaf *
+internal_bt_build_leaf(struct bt_build *b)
+{
+	struct bt_leaf *l = b->spare_leaves;
+	assert(l);
+	b->spare_leaves = l->next;
+	*l = (struct bt_leaf){.hdr = {.leaf = true}, .prev = b->last};
+	if (b->last)
+		b->last->next = l;
+	else
+		b->first = l;
+	return b->last = l;
+}
+
+struct map_pair *
+internal_bt_build_add(struct bt_build *b, struct map_pair pair)
+{
+	struct bt_leaf *l = b->last;
+	if (!l || l->hdr.count == LEAF_MAX)
+		l = internal_bt_build_leaf(b);
+	b->length++;
+	l->pairs[l->hdr.count] = pair;
+	return &l->pairs[l->hdr.count++];
+}
+
+void
+internal_bt_build_end(struct bt_build *b)
+{
+	struct bt_leaf *last = b->last ? b->last : internal_bt_build_leaf(b),
+	               *prev = last->prev;
+	if (prev && last->hdr.count < LEAF_MIN)
+	{
+		unsigned total = prev->hdr.count + last->hdr.count,
+		         move = total / 2 - last->hdr.count;
+		memmove(last->pairs + move, last->pairs,
+		        last->hdr.count * sizeof *last->pairs);
+		memcpy(last->pairs, prev->pairs + prev->hdr.count - move,
+		       move * sizeof *last->pairs);
+		prev->hdr.count -= move;
+		last->hdr.count += move;
+	}
+
+	size_t c = 0;
+	for (struct bt_leaf *l = b->first; l; l = l->next, c++)
+	{
+		b->level[c] = &l->hdr;
+		b->mins[c] = l->pairs[0].k;
+		b->sizes[c] = l->hdr.count;
+	}
+	while (c > 1)
+	{
+		size_t k = internal_bt_div_up(c, INNER_MAX + 1);
+		for (size_t j = 0; j < k; j++)
+		{
+			size_t from = c / k * j + c % k * j / k,
+			       to = c / k * (j+1) + c % k * (j+1) / k,
+			       total = 0;
+			struct bt_inner *in = b->spare_inners;
+			assert(in);
+			b->spare_inners = (struct bt_inner *)in->kids[0];
+			in->hdr = (struct bt_node){.count = (unsigned)(to - from - 1)};
+			for (size_t i = from; i < to; i++)
+			{
+				if (i > from)
+					in->keys[i - from - 1] = b->mins[i];
+				in->kids[i - from] = b->level[i];
+				in->sizes[i - from] = b->sizes[i];
+				total += b->sizes[i];
+			}
+			b->level[j] = &in->hdr;
+			b->mins[j] = b->mins[from];
+			b->sizes[j] = total;
+		}
+		c = k;
+	}
+
+	internal_bt_free_node(b->bt->root, NULL, NULL, NULL, NULL);
+	b->bt->root = b->level[0];
+	b->bt->first = b->first;
+	b->bt->last = last;
+	b->bt->length = b->length;
+	internal_bt_build_free(b);
+}
+
+struct bt_leaf *
+internal_bt_first(const struct btree *bt)
+{
+	return bt->first;
+}
+
+void
+internal_bt_last(const struct btree *bt, struct bt_leaf **leaf, size_t *pos)
+{
+	*leaf = bt->last;
+	*pos = bt->last->hdr.count;
+}
+
+void
+internal_bt_seek(const struct btree *bt, const void *key, bool strictly,
+                 struct bt_leaf **leaf, size_t *pos)
+{
+	const struct bt_node *n = bt->root;
+	bool eq;
+	while (!n->leaf)
+	{
+		const struct bt_inner *in = (const struct bt_inner *)n;
+		n = in->kids[internal_bt_inner_search(bt, in, key, &eq)];
+	}
+	*leaf = (struct bt_leaf *)n;
+	*pos = internal_bt_leaf_search(bt, *leaf, key, &eq);
+	if (eq && strictly)
+		(*pos)++;
+}
+
+struct map_pair *
+internal_bt_next(struct bt_leaf **leaf, size_t *pos)
+{
+	while (*pos >= (*leaf)->hdr.count)
+	{
+		if (!(*leaf)->next)
+			return NULL;
+		*leaf = (*leaf)->next;
+		*pos = 0;
+	}
+	return &(*leaf)->pairs[(*pos)++];
+}
+
+struct map_pair *
+internal_bt_prev(struct bt_leaf **leaf, size_t *pos)
+{
+	while (*pos == 0)
+	{
+		if (!(*leaf)->prev)
+			return NULL;
+		*leaf = (*leaf)->prev;
+		*pos = (*leaf)->hdr.count;
+	}
+	return &(*leaf)->pairs[--*pos];
+}
@@ -0,0 +1,522 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+#include "internal/alloc.h"
+#include "internal/atomic.h"
+#include "derp/chashmap.h"
+
+/* Readers never lock. They walk bucket chains that writers change
+ * only by atomically publishing whole nodes, so a reader sees either
+ * the old chain or the new one. Writers serialize per
+ * stripe of buckets, and a resize takes every stripe.
+ *
+ * Unlinked nodes can't be freed while a reader might be standing on
+ * one, so they wait in a limbo list. Freeing them uses two-epoch
+ * quiescence: readers announce which epoch they entered in, and a
+ * reclaimer flips the epoch and waits for every reader of the old one
+ * to leave. Reader counters are spread over cache lines, so readers
+ * on different threads don't contend for one counter. */
+
+#define DEFAULT_CAPACITY 64
+#define LOCK_STRIPES 64
+#define READER_SLOTS 64
+#define CACHE_LINE 64
+/* average chain length that triggers growth */
+#define MAX_LOAD 2
+/* retired nodes to accumulate before paying for a grace period */
+#define RECLAIM_BATCH 128
+
+/* which parts of a retired node are garbage */
+#define OWN_KEY 1
+#define OWN_VAL 2
+
+struct chm_node
+{
+	struct chm_node *next;
+	void *k, *v;
+	unsigned long hash;
+	struct chm_node *retired;
+	int owns;
+};
+
+struct chm_table
+{
+	size_t nbuckets; /* a power of two, no fewer than LOCK_STRIPES */
+	struct chm_node **buckets;
+	struct chm_table *retired;
+};
+
+union chm_reader_slot
+{
+	unsigned long active[2];
+	char pad[CACHE_LINE];
+};
+
+struct chashmap
+{
+	struct chm_table *table;
+	size_t length;
+	pthread_mutex_t stripes[LOCK_STRIPES];
+
+	unsigned epoch;
+	union chm_reader_slot readers[READER_SLOTS];
+	pthread_mutex_t reclaim_lock;
+	struct chm_node *limbo;
+	struct chm_table *limbo_tables;
+	size_t limbo_length;
+
+	dtor *key_dtor;
+	dtor *val_dtor;
+	hashfn *hash;
+	comparator *cmp;
+	void *cmp_aux;
+	void *dtor_aux;
+};
+
+/*** Reader slots ***/
+
+static pthread_key_t  slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+static bool           slot_key_ok;
+static size_t         slot_next;
+
+static void
+internal_chm_make_slot_key(void)
+{
+	slot_key_ok = pthread_key_create(&slot_key, NULL) == 0;
+}
+
+/* threads take slots round robin, and the first choice sticks */
+static size_t
+internal_chm_reader_slot(void)
+{
+	pthread_once(&slot_key_once, internal_chm_make_slot_key);
+	if (!slot_key_ok)
+		return 0;
+	uintptr_t s = (uintptr_t)pthread_getspecific(slot_key);
+	if (s == 0)
+	{
+		s = 1 + ATOMIC_FETCH_ADD(&slot_next, 1) % READER_SLOTS;
+		pthread_setspecific(slot_key, (void *)s);
+	}
+	return s - 1;
+}
+
+static unsigned
+internal_chm_enter(chashmap *h, size_t *slot)
+{
+	*slot = internal_chm_reader_slot();
+	unsigned long *active = h->readers[*slot].active;
+	for (;;)
+	{
+		unsigned e = ATOMIC_LOAD(&h->epoch);
+		ATOMIC_FETCH_ADD(&active[e], 1);
+		/* if the epoch flipped in between, a reclaimer may
+		 * have already checked our counter and missed us */
+		if (ATOMIC_LOAD(&h->epoch) == e)
+			return e;
+		ATOMIC_FETCH_SUB(&active[e], 1);
+	}
+}
+
+static void
+internal_chm_exit(chashmap *h, size_t slot, unsigned e)
+{
+	ATOMIC_FETCH_SUB(&h->readers[slot].active[e], 1);
+}
+
+/*** Reclamation ***/
+
+static void
+internal_chm_destroy_node(chashmap *h, struct chm_node *n)
+{
+	if ((n->owns & OWN_KEY) && h->key_dtor)
+		h->key_dtor(n->k, h->dtor_aux);
+	if ((n->owns & OWN_VAL) && h->val_dtor)
+		h->val_dtor(n->v, h->dtor_aux);
+	internal_free(n);
+}
+
+static void
+internal_chm_destroy_table(struct chm_table *t)
+{
+	internal_free(t->buckets);
+	internal_free(t);
+}
+
+/* caller holds reclaim_lock */
+static void
+internal_chm_reclaim(chashmap *h)
+{
+	unsigned e = ATOMIC_LOAD(&h->epoch);
+	ATOMIC_STORE(&h->epoch, !e);
+	for (size_t i = 0; i < READER_SLOTS; i++)
+		while (ATOMIC_LOAD(&h->readers[i].active[e]) != 0)
+			sched_yield();
+
+	/* everything in limbo was unlinked before the flip,
+	 * and the readers who might have seen it are gone */
+	while (h->limbo)
+	{
+		struct chm_node *n = h->limbo;
+		h->limbo = n->retired;
+		internal_chm_destroy_node(h, n);
+	}
+	while (h->limbo_tables)
+	{
+		struct chm_table *t = h->limbo_tables;
+		h->limbo_tables = t->retired;
+		internal_chm_destroy_table(t);
+	}
+	h->limbo_length = 0;
+}
+
+/* nodes arrive linked through their retired field */
+static void
+internal_chm_retire(chashmap *h, struct chm_node *nodes,
+                    struct chm_table *table)
+{
+	pthread_mutex_lock(&h->reclaim_lock);
+	while (nodes)
+	{
+		struct chm_node *n = nodes;
+		nodes = n->retired;
+		n->retired = h->limbo;
+		h->limbo = n;
+		h->limbo_length++;
+	}
+	if (table)
+	{
+		table->retired = h->limbo_tables;
+		h->limbo_tables = table;
+		/* tables are large, so don't let them linger */
+		h->limbo_length += RECLAIM_BATCH;
+	}
+	if (h->limbo_length >= RECLAIM_BATCH)
+		internal_chm_reclaim(h);
+	pthread_mutex_unlock(&h->reclaim_lock);
+}
+
+/*** Tables ***/
+
+static uint64_t
+internal_chm_mix(unsigned long hash)
+{
+	uint64_t x = hash;
+	x ^= x >> 33;
+	x *= UINT64_C(0xff51afd7ed558ccd);
+	x ^= x >> 33;
+	return x;
+}
+
+/* Stripes are chosen by low bits of the mixed hash, as buckets are.
+ * With at least LOCK_STRIPES buckets, each bucket belongs to exactly
+ * one stripe at every table size. */
+static pthread_mutex_t *
+internal_chm_stripe(chashmap *h, unsigned long hash)
+{
+	return &h->stripes[internal_chm_mix(hash) & (LOCK_STRIPES-1)];
+}
+
+static struct chm_node **
+internal_chm_bucket(struct chm_table *t, unsigned long hash)
+{
+	return &t->buckets[internal_chm_mix(hash) & (t->nbuckets-1)];
+}
+
+static struct chm_table *
+internal_chm_new_table(size_t nbuckets)
+{
+	if (nbuckets > SIZE_MAX / sizeof(struct chm_node *))
+		return NULL;
+	struct chm_table *t = internal_malloc(sizeof *t);
+	struct chm_node **b = internal_malloc(nbuckets * sizeof *b);
+	if (!t || !b)
+	{
+		internal_free(t);
+		internal_free(b);
+		return NULL;
+	}
+	for (size_t i = 0; i < nbuckets; i++)
+		b[i] = NULL;
+	*t = (struct chm_table){.nbuckets = nbuckets, .buckets = b};
+	return t;
+}
+
+/* Lock the stripe for hash in the current table. The table can be
+ * replaced while we wait for the lock, so check it afterward. */
+static struct chm_table *
+internal_chm_lock(chashmap *h, unsigned long hash)
+{
+	pthread_mutex_t *m = internal_chm_stripe(h, hash);
+	for (;;)
+	{
+		struct chm_table *t = ATOMIC_LOAD(&h->table);
+		pthread_mutex_lock(m);
+		if (ATOMIC_LOAD(&h->table) == t)
+			return t;
+		pthread_mutex_unlock(m);
+	}
+}
+
+/* Readers may still be walking the old chains, so they can't be
+ * relinked. Copy every node into the new table instead, and retire
+ * the originals without destroying their keys and values. */
+static void
+internal_chm_grow(chashmap *h)
+{
+	for (size_t i = 0; i < LOCK_STRIPES; i++)
+		pthread_mutex_lock(&h->stripes[i]);
+
+	struct chm_table *old = h->table, *t = NULL;
+	struct chm_node *garbage = NULL;
+	size_t length = ATOMIC_LOAD(&h->length);
+	/* another writer may have beaten us to it */
+	if (length <= old->nbuckets * MAX_LOAD ||
+	    old->nbuckets > SIZE_MAX / 2 ||
+	    !(t = internal_chm_new_table(old->nbuckets * 2)))
+		goto done;
+
+	for (size_t i = 0; i < old->nbuckets; i++)
+		for (struct chm_node *n = old->buckets[i]; n; n = n->next)
+		{
+			struct chm_node *copy = internal_malloc(sizeof *copy);
+			if (!copy)
+			{
+				/* stay at the old size, it still works */
+				for (size_t j = 0; j < t->nbuckets; j++)
+					while (t->buckets[j])
+					{
+						struct chm_node *c = t->buckets[j];
+						t->buckets[j] = c->next;
+						internal_free(c);
+					}
+				internal_chm_destroy_table(t);
+				t = NULL;
+				goto done;
+			}
+			struct chm_node **b = internal_chm_bucket(t, n->hash);
+			*copy = (struct chm_node){
+				.next = *b, .k = n->k, .v = n->v, .hash = n->hash,
+				.owns = OWN_KEY | OWN_VAL
+			};
+			*b = copy;
+		}
+
+	for (size_t i = 0; i < old->nbuckets; i++)
+		for (struct chm_node *n = old->buckets[i]; n; n = n->next)
+		{
+			n->owns = 0;
+			n->retired = garbage;
+			garbage = n;
+		}
+	ATOMIC_STORE(&h->table, t);
+
+done:
+	for (size_t i = LOCK_STRIPES; i > 0; i--)
+		pthread_mutex_unlock(&h->stripes[i-1]);
+	if (t)
+		internal_chm_retire(h, garbage, old);
+}
+
+/*** Public API ***/
+
+chashmap *
+chm_new(size_t capacity, hashfn *hash,
+        comparator *cmp, void *cmp_aux)
+{
+	if (!hash || !cmp)
+		return NULL;
+	if (capacity == 0)
+		capacity = DEFAULT_CAPACITY;
+	size_t nbuckets = LOCK_STRIPES;
+	while (nbuckets * MAX_LOAD < capacity && nbuckets <= SIZE_MAX / 2)
+		nbuckets *= 2;
+
+	chashmap *h = internal_malloc(sizeof *h);
+	struct chm_table *t = internal_chm_new_table(nbuckets);
+	if (!h || !t)
+	{
+		internal_free(h);
+		if (t)
+			internal_chm_destroy_table(t);
+		return NULL;
+	}
+	*h = (chashmap){
+		.table = t,
+		.hash = hash,
+		.cmp = cmp,
+		.cmp_aux = cmp_aux
+	};
+	for (size_t i = 0; i < LOCK_STRIPES; i++)
+		pthread_mutex_init(&h->stripes[i], NULL);
+	pthread_mutex_init(&h->reclaim_lock, NULL);
+	return h;
+}
+
+void
+chm_dtor(chashmap *h, dtor *key_dtor, dtor *val_dtor, void *dtor_aux)
+{
+	if (!h)
+		return;
+	h->key_dtor = key_dtor;
+	h->val_dtor = val_dtor;
+	h->dtor_aux = dtor_aux;
+}
+
+void
+chm_free(chashmap *h)
+{
+	if (!h)
+		return;
+	chm_clear(h);
+	/* nobody else may be using the map by now */
+	pthread_mutex_lock(&h->reclaim_lock);
+	internal_chm_reclaim(h);
+	pthread_mutex_unlock(&h->reclaim_lock);
+	internal_chm_destroy_table(h->table);
+	for (size_t i = 0; i < LOCK_STRIPES; i++)
+		pthread_mutex_destroy(&h->stripes[i]);
+	pthread_mutex_destroy(&h->reclaim_lock);
+	internal_free(h);
+}
+
+size_t
+chm_length(const chashmap *h)
+{
+	return h ? ATOMIC_LOAD(&h->length) : 0;
+}
+
+bool
+chm_is_empty(const chashmap *h)
+{
+	return chm_length(h) == 0;
+}
+
+void *
+chm_at(chashmap *h, const void *key)
+{
+	if (!h)
+		return NULL;
+	unsigned long hash = h->hash(key);
+	void *v = NULL;
+	size_t slot;
+	unsigned e = internal_chm_enter(h, &slot);
+
+	struct chm_table *t = ATOMIC_LOAD(&h->table);
+	struct chm_node *n = ATOMIC_LOAD(internal_chm_bucket(t, hash));
+	for (; n; n = ATOMIC_LOAD(&n->next))
+		if (n->hash == hash && h->cmp(n->k, key, h->cmp_aux) == 0)
+		{
+			v = n->v;
+			break;
+		}
+
+	internal_chm_exit(h, slot, e);
+	return v;
+}
+
+bool
+chm_insert(chashmap *h, void *key, void *val)
+{
+	if (!h)
+		return false;
+	unsigned long hash = h->hash(key);
+	/* allocate outside the lock */
+	struct chm_node *fresh = internal_malloc(sizeof *fresh);
+	if (!fresh)
+		return false;
+	*fresh = (struct chm_node){
+		.k = key, .v = val, .hash = hash, .owns = OWN_KEY | OWN_VAL
+	};
+
+	struct chm_table *t = internal_chm_lock(h, hash);
+	struct chm_node **link = internal_chm_bucket(t, hash), *n;
+	for (n = *link; n; link = &n->next, n = n->next)
+		if (n->hash == hash && h->cmp(n->k, key, h->cmp_aux) == 0)
+			break;
+
+	bool grow = false, replaced = false;
+	if (!n)
+	{
+		fresh->next = *link;
+		ATOMIC_STORE(link, fresh);
+		grow = ATOMIC_FETCH_ADD(&h->length, 1) + 1 >
+		       t->nbuckets * MAX_LOAD;
+	}
+	else if (n->v != val)
+	{
+		/* Readers may be holding n, so swap in a replacement
+		 * rather than changing it. Like hm_insert, keep the
+		 * key that was already there. */
+		fresh->k = n->k;
+		fresh->next = n->next;
+		ATOMIC_STORE(link, fresh);
+		n->owns = OWN_VAL;
+		n->retired = NULL;
+		replaced = true;
+	}
+	pthread_mutex_unlock(internal_chm_stripe(h, hash));
+
+	if (replaced)
+		internal_chm_retire(h, n, NULL);
+	else if (n)
+		internal_free(fresh); /* same value, nothing to do */
+	if (grow)
+		internal_chm_grow(h);
+	return true;
+}
+
+bool
+chm_remove(chashmap *h, void *key)
+{
+	if (!h)
+		return false;
+	unsigned long hash = h->hash(key);
+	struct chm_table *t = internal_chm_lock(h, hash);
+	struct chm_node **link = internal_chm_bucket(t, hash), *n;
+	for (n = *link; n; link = &n->next, n = n->next)
+		if (n->hash == hash && h->cmp(n->k, key, h->cmp_aux) == 0)
+			break;
+	if (n)
+	{
+		/* n->next stays intact for readers already on n */
+		ATOMIC_STORE(link, n->next);
+		ATOMIC_FETCH_SUB(&h->length, 1);
+		n->retired = NULL;
+	}
+	pthread_mutex_unlock(internal_chm_stripe(h, hash));
+
+	if (n)
+		internal_chm_retire(h, n, NULL);
+	return n != NULL;
+}
+
+void
+chm_clear(chashmap *h)
+{
+	if (!h)
+		return;
+	for (size_t i = 0; i < LOCK_STRIPES; i++)
+		pthread_mutex_lock(&h->stripes[i]);
+
+	struct chm_node *garbage = NULL;
+	struct chm_table *t = h->table;
+	for (size_t i = 0; i < t->nbuckets; i++)
+	{
+		for (struct chm_node *n = t->buckets[i]; n; n = n->next)
+		{
+			n->retired = garbage;
+			garbage = n;
+		}
+		ATOMIC_STORE(&t->buckets[i], NULL);
+	}
+	ATOMIC_STORE(&h->length, 0);
+
+	for (size_t i = LOCK_STRIPES; i > 0; i--)
+		pthread_mutex_unlock(&h->stripes[i-1]);
+	internal_chm_retire(h, garbage, NULL);
+}
@@ -4,6 +4,17 @@
 #include "internal/alloc.h"
 #include "derp/common.h"
 
+#if defined(__GNUC__)
+	#include "internal/atomic.h"
+#endif
+
+/* only hosted Unix-likes have /dev/urandom and a clock to read */
+#if defined(__unix__) || defined(__APPLE__)
+	#include <stdio.h>
+	#include <time.h>
+	#define HAVE_URANDOM
+#endif
+
 int derp_strcmp(const void *a, const void *b, void *aux)
 {
 	(void)aux;
@@ -29,3 +40,208 @@ void derp_free(void *a, void *aux)
 	(void)aux;
 	internal_free(a);
 }
+
+/*** Hashing ***/
+
+/* Wang Yi's wyhash, final version 4
+ * https://github.com/wangyi-fudan/wyhash (public domain)
+ *
+ * Reads eight bytes at a time and folds them in with a 64x64->128
+ * bit multiply, which modern compilers turn into one instruction. */
+
+static const uint64_t wyp[4] = {
+	UINT64_C(0xa0761d6478bd642f), UINT64_C(0xe7037ed1a0b428db),
+	UINT64_C(0x8ebc6af09c88c6e3), UINT64_C(0x589965cc75374cc3)
+};
+
+/* replace a and b with the low and high halves of their product */
+static void internal_mum(uint64_t *a, uint64_t *b)
+{
+#if defined(__SIZEOF_INT128__)
+	__extension__ typedef unsigned __int128 u128;
+	u128 r = (u128)*a * *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32,
+	         la = (uint32_t)*a, lb = (uint32_t)*b,
+	         rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb,
+	         t = rl + (rm0 << 32), c = t < rl, lo, hi;
+	lo = t + (rm1 << 32);
+	c += lo < t;
+	hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+	*a = lo;
+	*b = hi;
+#endif
+}
+
+static uint64_t internal_mix(uint64_t a, uint64_t b)
+{
+	internal_mum(&a, &b);
+	return a ^ b;
+}
+
+static uint64_t internal_read8(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static uint64_t internal_read4(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+/* one to three bytes */
+static uint64_t internal_read3(const unsigned char *p, size_t k)
+{
+	return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k-1];
+}
+
+uint64_t derp_hash_bytes(const void *key, size_t len, uint64_t seed)
+{
+	const unsigned char *p = key;
+	uint64_t a, b;
+	seed ^= internal_mix(seed ^ wyp[0], wyp[1]);
+	if (len <= 16)
+	{
+		if (len >= 4)
+		{
+			size_t mid = (len >> 3) << 2;
+			a = (internal_read4(p) << 32) | internal_read4(p + mid);
+			b = (internal_read4(p + len - 4) << 32) |
+			    internal_read4(p + len - 4 - mid);
+		}
+		else if (len > 0)
+		{
+			a = internal_read3(p, len);
+			b = 0;
+		}
+		else
+			a = b = 0;
+	}
+	else
+	{
+		size_t i = len;
+		if (i > 48)
+		{
+			uint64_t see1 = seed, see2 = seed;
+			do
+			{
+				seed = internal_mix(internal_read8(p) ^ wyp[1],
+				                    internal_read8(p+8) ^ seed);
+				see1 = internal_mix(internal_read8(p+16) ^ wyp[2],
+				                    internal_read8(p+24) ^ see1);
+				see2 = internal_mix(internal_read8(p+32) ^ wyp[3],
+				                    internal_read8(p+40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16)
+		{
+			seed = internal_mix(internal_read8(p) ^ wyp[1],
+			                    internal_read8(p+8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = internal_read8(p + i - 16);
+		b = internal_read8(p + i - 8);
+	}
+	a ^= wyp[1];
+	b ^= seed;
+	internal_mum(&a, &b);
+	return internal_mix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+}
+
+/* Not cryptographic, just hard to guess from outside the process.
+ * Where /dev/urandom can't be read, the clock and addresses (under
+ * ASLR) still vary between runs. Elsewhere there are only addresses,
+ * and no libc calls, so embedded targets link without stdio. */
+static uint64_t internal_random_seed(void)
+{
+	uint64_t s = 0;
+#ifdef HAVE_URANDOM
+	FILE *f = fopen("/dev/urandom", "rb");
+	if (f)
+	{
+		if (fread(&s, sizeof s, 1, f) != 1)
+			s = 0;
+		fclose(f);
+	}
+	uint64_t noise[4] = {
+		(uint64_t)time(NULL), (uint64_t)clock(),
+		(uint64_t)(uintptr_t)&s, (uint64_t)(uintptr_t)&noise
+	};
+#else
+	uint64_t noise[2] = {
+		(uint64_t)(uintptr_t)&s, (uint64_t)(uintptr_t)&noise
+	};
+#endif
+	s = derp_hash_bytes(noise, sizeof noise, s);
+	return s ? s : 1; /* zero means unset */
+}
+
+static uint64_t hash_seed;
+
+uint64_t derp_hash_seed(void)
+{
+#if defined(__GNUC__)
+	uint64_t s = ATOMIC_LOAD(&hash_seed);
+	if (s)
+		return s;
+	/* racing threads agree on whichever seed lands first */
+	uint64_t fresh = internal_random_seed();
+	return ATOMIC_CAS(&hash_seed, &s, fresh) ? fresh : s;
+#else
+	if (!hash_seed)
+		hash_seed = internal_random_seed();
+	return hash_seed;
+#endif
+}
+
+void derp_hash_set_seed(uint64_t seed)
+{
+	if (!seed)
+		seed = 1;
+#if defined(__GNUC__)
+	ATOMIC_STORE(&hash_seed, seed);
+#else
+	hash_seed = seed;
+#endif
+}
+
+unsigned long derp_hash_str(const void *s)
+{
+	return derp_hash_bytes(s, strlen(s), derp_hash_seed());
+}
+
+unsigned long derp_hash_u64(const void *x)
+{
+	return internal_mix(*(const uint64_t *)x ^ wyp[0],
+	                    derp_hash_seed() ^ wyp[1]);
+}
+
+int derp_u64cmp(const void *a, const void *b, void *aux)
+{
+	(void)aux;
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+unsigned long derp_hash_ptr(const void *p)
+{
+	return internal_mix((uint64_t)(uintptr_t)p ^ wyp[0],
+	                    derp_hash_seed() ^ wyp[1]);
+}
+
+int derp_ptrcmp(const void *a, const void *b, void *aux)
+{
+	(void)aux;
+	uintptr_t x = (uintptr_t)a, y = (uintptr_t)b;
+	return (x > y) - (x < y);
+}
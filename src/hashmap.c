@@ -1,15 +1,81 @@
 #include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
 
 #include "internal/alloc.h"
 #include "derp/hashmap.h"
-#include "derp/list.h"
+
+/* Open addressing in the style of Abseil's "Swiss tables"
+ * https://abseil.io/about/design/swisstables
+ *
+ * Slots are split into groups of GROUP_WIDTH, and every slot has a
+ * control byte saying whether it is empty, deleted, or full. Full
+ * slots keep seven bits of the hash in their control byte, so one
+ * SSE2 compare can rule out most of a group before we ever touch the
+ * keys. Probing moves between whole groups, and stops at the first
+ * group that still has an empty slot. */
 
 #define DEFAULT_CAPACITY 64
+#define GROUP_WIDTH 16
+
+/* groups moved out of an old table by each insert or remove
+ * while a resize is underway */
+#define MIGRATE_GROUPS 2
+
+#define CTRL_EMPTY   0x80
+#define CTRL_DELETED 0xFE
+/* full slots hold H2 of their hash, 0x00 - 0x7F */
+#define CTRL_IS_FULL(c) ((c) < 0x80)
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((unsigned char)((hash) & 0x7F))
+
+#define NOT_FOUND SIZE_MAX
+
+/* keys hashed and prefetched at once by the batch functions */
+#define BATCH_LEN 16
+
+#if defined(__GNUC__)
+	#define PREFETCH(p) __builtin_prefetch(p)
+#else
+	#define PREFETCH(p) (void)(p)
+#endif
+
+/* bit i is set when slot i of a group matches */
+typedef uint32_t bitmask;
+
+/* The full hash is kept alongside each entry. Lookups only call the
+ * comparator when the whole hash matches, and resizes never call the
+ * user's hash function again. */
+struct hm_slot
+{
+	struct map_pair pair;
+	uint64_t hash;
+};
+
+struct hm_table
+{
+	size_t capacity; /* slots, a power of two and multiple of GROUP_WIDTH */
+	size_t growth_left; /* empty slots we may fill before a rehash */
+	unsigned char *ctrl;
+	struct hm_slot *slots;
+};
+
+/* Resizing is incremental. A resize allocates the new table and
+ * keeps the previous one in "old," and then each insert or remove
+ * moves a few groups across. Lookups check both tables until the
+ * old one is drained. */
 
 struct hashmap
 {
-	size_t capacity;
-	list **buckets;
+	struct hm_table cur, old;
+	size_t migrated; /* slots of old already moved into cur */
+	size_t length;
+	size_t min_capacity;
 
 	dtor *key_dtor;
 	dtor *val_dtor;
@@ -19,25 +85,343 @@ struct hashmap
 	void *dtor_aux;
 };
 
-struct hm_iter
+/*** Group probing ***/
+
+static bitmask
+internal_match(const unsigned char *group, unsigned char c)
 {
-	hashmap *h;
-	size_t bucket;
-	list_item *offset;
-};
+#ifdef __SSE2__
+	__m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+	return (bitmask)_mm_movemask_epi8(
+		_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)c)));
+#else
+	bitmask m = 0;
+	for (int i = 0; i < GROUP_WIDTH; i++)
+		if (group[i] == c)
+			m |= (bitmask)1 << i;
+	return m;
+#endif
+}
+
+/* empty or deleted slots both have their high bit set */
+static bitmask
+internal_match_free(const unsigned char *group)
+{
+#ifdef __SSE2__
+	return (bitmask)_mm_movemask_epi8(
+		_mm_loadu_si128((const __m128i *)group));
+#else
+	bitmask m = 0;
+	for (int i = 0; i < GROUP_WIDTH; i++)
+		if (!CTRL_IS_FULL(group[i]))
+			m |= (bitmask)1 << i;
+	return m;
+#endif
+}
+
+static unsigned
+internal_lowest_bit(bitmask m)
+{
+	assert(m);
+#if defined(__GNUC__)
+	return (unsigned)__builtin_ctz(m);
+#else
+	unsigned i = 0;
+	while (!(m & 1))
+	{
+		m >>= 1;
+		i++;
+	}
+	return i;
+#endif
+}
 
+/* user hash functions can be weak in their low bits, and
+ * we take both the group and the control byte from there */
+static uint64_t
+internal_hm_hash(const hashmap *h, const void *key)
+{
+	uint64_t x = h->hash(key);
+	x ^= x >> 33;
+	x *= UINT64_C(0xff51afd7ed558ccd);
+	x ^= x >> 33;
+	return x;
+}
+
+static size_t
+internal_hm_groups(size_t capacity)
+{
+	return capacity / GROUP_WIDTH;
+}
+
+/* keep at least one slot in eight empty so probes terminate quickly */
+static size_t
+internal_hm_max_load(size_t capacity)
+{
+	return capacity - capacity / 8;
+}
+
+static size_t
+internal_hm_find(const hashmap *h, const struct hm_table *t,
+                 const void *key, uint64_t hash)
+{
+	size_t mask = internal_hm_groups(t->capacity) - 1,
+	       g = H1(hash) & mask;
+	unsigned char h2 = H2(hash);
+	for (size_t step = 1; ; step++)
+	{
+		const unsigned char *group = t->ctrl + g*GROUP_WIDTH;
+		for (bitmask m = internal_match(group, h2); m; m &= m-1)
+		{
+			size_t i = g*GROUP_WIDTH + internal_lowest_bit(m);
+			if (t->slots[i].hash == hash &&
+			    h->cmp(t->slots[i].pair.k, key, h->cmp_aux) == 0)
+				return i;
+		}
+		if (internal_match(group, CTRL_EMPTY))
+			return NOT_FOUND;
+		/* triangular numbers visit every group when
+		 * the group count is a power of two */
+		g = (g + step) & mask;
+	}
+}
+
+/* first empty or deleted slot on the probe sequence for hash */
+static size_t
+internal_hm_find_free(const struct hm_table *t, uint64_t hash)
+{
+	size_t mask = internal_hm_groups(t->capacity) - 1,
+	       g = H1(hash) & mask;
+	for (size_t step = 1; ; step++)
+	{
+		bitmask m = internal_match_free(t->ctrl + g*GROUP_WIDTH);
+		if (m)
+			return g*GROUP_WIDTH + internal_lowest_bit(m);
+		g = (g + step) & mask;
+	}
+}
+
+/* look in the current table, then in any table being drained */
+static struct hm_table *
+internal_hm_lookup(const hashmap *h, const void *key, uint64_t hash,
+                   size_t *slot)
+{
+	*slot = internal_hm_find(h, &h->cur, key, hash);
+	if (*slot != NOT_FOUND)
+		return (struct hm_table *)&h->cur;
+	if (!h->old.ctrl)
+		return NULL;
+	*slot = internal_hm_find(h, &h->old, key, hash);
+	if (*slot != NOT_FOUND)
+		return (struct hm_table *)&h->old;
+	return NULL;
+}
+
+static size_t
+internal_hm_place(struct hm_table *t, struct hm_slot slot)
+{
+	uint64_t hash = slot.hash;
+	size_t i = internal_hm_find_free(t, hash);
+	if (t->ctrl[i] == CTRL_EMPTY)
+		t->growth_left--;
+	t->ctrl[i] = H2(hash);
+	t->slots[i] = slot;
+	return i;
+}
+
+/* smallest table whose load limit admits n entries */
+static size_t
+internal_hm_capacity_for(size_t n)
+{
+	size_t c = GROUP_WIDTH;
+	while (internal_hm_max_load(c) < n)
+	{
+		if (c > SIZE_MAX / 2)
+			return 0;
+		c *= 2;
+	}
+	return c;
+}
+
+/* control bytes and slots share one allocation. Capacity is
+ * a multiple of GROUP_WIDTH, so the slots stay aligned */
+static bool
+internal_hm_alloc(struct hm_table *t, size_t capacity)
+{
+	if (capacity == 0 ||
+	    capacity > SIZE_MAX / (1 + sizeof *t->slots))
+		return false;
+	unsigned char *mem =
+		internal_malloc(capacity * (1 + sizeof *t->slots));
+	if (!mem)
+		return false;
+	memset(mem, CTRL_EMPTY, capacity);
+	*t = (struct hm_table){
+		.capacity = capacity,
+		.growth_left = internal_hm_max_load(capacity),
+		.ctrl = mem,
+		.slots = (struct hm_slot *)(mem + capacity)
+	};
+	return true;
+}
+
+/* move up to n groups from the old table into the current one */
+static void
+internal_hm_migrate(hashmap *h, size_t groups)
+{
+	if (!h->old.ctrl)
+		return;
+	size_t end = h->migrated + groups*GROUP_WIDTH;
+	if (end > h->old.capacity)
+		end = h->old.capacity;
+	for (size_t i = h->migrated; i < end; i++)
+	{
+		if (!CTRL_IS_FULL(h->old.ctrl[i]))
+			continue;
+		internal_hm_place(&h->cur, h->old.slots[i]);
+		/* a tombstone, so probes through this group still
+		 * reach entries that are waiting their turn */
+		h->old.ctrl[i] = CTRL_DELETED;
+	}
+	h->migrated = end;
+	if (h->migrated == h->old.capacity)
+	{
+		internal_free(h->old.ctrl);
+		h->old = (struct hm_table){0};
+		h->migrated = 0;
+	}
+}
+
+static void
+internal_hm_finish_migration(hashmap *h)
+{
+	if (h->old.ctrl)
+		internal_hm_migrate(h, internal_hm_groups(h->old.capacity));
+}
+
+/* the most inserts and removes it can take to drain a table */
+static size_t
+internal_hm_drain_ops(size_t capacity)
+{
+	size_t per_op = MIGRATE_GROUPS*GROUP_WIDTH;
+	return (capacity + per_op - 1) / per_op;
+}
+
+/* Begin moving entries into a table of the given capacity. The new
+ * table must have room for every entry plus one insert per operation
+ * until the old table drains, so that it can't fill mid-migration. */
+static bool
+internal_hm_resize(hashmap *h, size_t capacity)
+{
+	assert(!h->old.ctrl);
+	assert(internal_hm_max_load(capacity) >
+	       h->length + internal_hm_drain_ops(h->cur.capacity));
+	struct hm_table t;
+	if (!internal_hm_alloc(&t, capacity))
+		return false;
+	h->old = h->cur;
+	h->cur = t;
+	h->migrated = 0;
+	return true;
+}
+
+/* leaves the map alone on failure, it still works when full of
+ * tombstones or sparse, just less efficiently */
 static void
-internal_hm_free_pair(void *x, void *aux)
+internal_hm_maybe_shrink(hashmap *h)
+{
+	size_t c = h->cur.capacity;
+	if (h->old.ctrl || c <= h->min_capacity ||
+	    h->length > internal_hm_max_load(c) / 8)
+		return;
+	size_t n = h->length + internal_hm_drain_ops(c) + 1;
+	if (n < h->length * 2)
+		n = h->length * 2;
+	size_t target = internal_hm_capacity_for(n);
+	if (target < h->min_capacity)
+		target = h->min_capacity;
+	if (target < c)
+		internal_hm_resize(h, target);
+}
+
+/* Replay the probe a lookup for hash would make, up to the given slot
+ * or (for NOT_FOUND) the end of an unsuccessful search. Counts groups
+ * visited, and the slots whose full hash matches, each of which costs
+ * a call to the comparator. */
+static void
+internal_hm_probe_cost(const struct hm_table *t, uint64_t hash,
+                       size_t slot, size_t *groups, size_t *cmps)
+{
+	size_t mask = internal_hm_groups(t->capacity) - 1,
+	       g = H1(hash) & mask;
+	unsigned char h2 = H2(hash);
+	for (size_t step = 1; ; step++)
+	{
+		const unsigned char *group = t->ctrl + g*GROUP_WIDTH;
+		(*groups)++;
+		for (bitmask m = internal_match(group, h2); m; m &= m-1)
+		{
+			size_t i = g*GROUP_WIDTH + internal_lowest_bit(m);
+			if (t->slots[i].hash == hash)
+				(*cmps)++;
+			if (i == slot)
+				return;
+		}
+		if (internal_match(group, CTRL_EMPTY))
+			return;
+		g = (g + step) & mask;
+	}
+}
+
+static void
+internal_hm_table_stats(const hashmap *h, const struct hm_table *t,
+                        struct hm_stats *s, size_t *total_cmps)
+{
+	for (size_t i = 0; i < t->capacity; i++)
+	{
+		if (t->ctrl[i] == CTRL_DELETED)
+			s->tombstones++;
+		if (!CTRL_IS_FULL(t->ctrl[i]))
+			continue;
+		uint64_t hash = t->slots[i].hash;
+		size_t groups = 0;
+		/* lookups search the old table only after missing in cur */
+		if (t == &h->old)
+			internal_hm_probe_cost(&h->cur, hash, NOT_FOUND,
+			                       &groups, total_cmps);
+		internal_hm_probe_cost(t, hash, i, &groups, total_cmps);
+
+		if (groups > s->max_probe)
+			s->max_probe = groups;
+		s->probe_hist[groups < HM_PROBE_HIST_LEN
+		              ? groups-1 : HM_PROBE_HIST_LEN-1]++;
+	}
+}
+
+static void
+internal_hm_free_pair(hashmap *h, struct map_pair *p)
 {
-	hashmap *h = aux;
-	struct map_pair *p = x;
 	if (h->key_dtor)
 		h->key_dtor(p->k, h->dtor_aux);
 	if (h->val_dtor)
 		h->val_dtor(p->v, h->dtor_aux);
-	internal_free(x);
 }
 
+static void
+internal_hm_free_table(hashmap *h, struct hm_table *t)
+{
+	if (!t->ctrl)
+		return;
+	if (h->key_dtor || h->val_dtor)
+		for (size_t i = 0; i < t->capacity; i++)
+			if (CTRL_IS_FULL(t->ctrl[i]))
+				internal_hm_free_pair(h, &t->slots[i].pair);
+	internal_free(t->ctrl);
+	*t = (struct hm_table){0};
+}
+
+/*** Public API ***/
+
 hashmap *
 hm_new(size_t capacity, hashfn *hash,
        comparator *cmp, void *cmp_aux)
@@ -48,34 +432,21 @@ hm_new(size_t capacity, hashfn *hash,
 		capacity = DEFAULT_CAPACITY;
 	hashmap *h = internal_malloc(sizeof *h);
 	if (!h)
-		goto fail;
+		return NULL;
 	*h = (hashmap){
-		.capacity = capacity,
-		.buckets = internal_malloc(capacity * sizeof *h->buckets),
+		.min_capacity = internal_hm_capacity_for(capacity),
 		.hash = hash,
 		.cmp = cmp,
 		.cmp_aux = cmp_aux
 	};
-	if (!h->buckets)
-		goto fail;
-
-	size_t i;
-	for (i = 0; i < capacity; i++)
-		h->buckets[i] = NULL; /* in case allocation fails part-way */
-	for (i = 0; i < capacity; i++)
+	if (!internal_hm_alloc(&h->cur, h->min_capacity))
 	{
-		if (!(h->buckets[i] = l_new()))
-			goto fail;
-		l_dtor(h->buckets[i], internal_hm_free_pair, h);
+		internal_free(h);
+		return NULL;
 	}
 	return h;
-
-fail:
-	hm_free(h);
-	return NULL;
 }
 
-
 void
 hm_dtor(hashmap *h, dtor *key_dtor, dtor *val_dtor, void *dtor_aux)
 {
@@ -91,24 +462,15 @@ hm_free(hashmap *h)
 {
 	if (!h)
 		return;
-	if (h->buckets)
-	{
-		for (size_t i = 0; i < h->capacity; i++)
-			l_free(h->buckets[i]);
-		internal_free(h->buckets);
-	}
+	internal_hm_free_table(h, &h->old);
+	internal_hm_free_table(h, &h->cur);
 	internal_free(h);
 }
 
 size_t
 hm_length(const hashmap *h)
 {
-	if (!h)
-		return 0;
-	size_t i, n;
-	for (n = i = 0; i < h->capacity; i++)
-		n += l_length(h->buckets[i]);
-	return n;
+	return h ? h->length : 0;
 }
 
 bool
@@ -117,13 +479,52 @@ hm_is_empty(const hashmap *h)
 	return hm_length(h) == 0;
 }
 
-/* kinda weird assumption: p is struct pair*, k is type of p->k */
-static int
-internal_hm_cmp(const void *p, const void *k, void *aux)
+bool
+hm_reserve(hashmap *h, size_t n)
 {
-	assert(p); assert(k); assert(aux);
-	hashmap *h = aux;
-	return h->cmp(((const struct map_pair *)p)->k, k, h->cmp_aux);
+	if (!h)
+		return false;
+	size_t want = internal_hm_capacity_for(n), c = want;
+	if (want == 0)
+		return false;
+	if (c > h->cur.capacity)
+	{
+		/* the caller asked for the work now, so
+		 * don't leave it for later operations */
+		internal_hm_finish_migration(h);
+		if (internal_hm_max_load(c) <=
+		    h->length + internal_hm_drain_ops(h->cur.capacity))
+		{
+			if (c > SIZE_MAX / 2)
+				return false;
+			c *= 2;
+		}
+		if (!internal_hm_resize(h, c))
+			return false;
+		internal_hm_finish_migration(h);
+	}
+	h->min_capacity = want;
+	return true;
+}
+
+bool
+hm_stats(const hashmap *h, struct hm_stats *s)
+{
+	if (!h || !s)
+		return false;
+	*s = (struct hm_stats){
+		.length = h->length,
+		.capacity = h->cur.capacity + h->old.capacity
+	};
+	s->load_factor = (double)s->length / s->capacity;
+
+	size_t total_cmps = 0;
+	if (h->old.ctrl)
+		internal_hm_table_stats(h, &h->old, s, &total_cmps);
+	internal_hm_table_stats(h, &h->cur, s, &total_cmps);
+	if (h->length > 0)
+		s->cmps_per_hit = (double)total_cmps / h->length;
+	return true;
 }
 
 void *
@@ -131,11 +532,68 @@ hm_at(const hashmap *h, const void *key)
 {
 	if (!h)
 		return NULL;
-	list *bucket = h->buckets[h->hash(key) % h->capacity];
-	list_item *li = l_find(bucket, key, internal_hm_cmp, (void*)h);
-	if (!li)
-		return NULL;
-	return ((struct map_pair*)li->data)->v;
+	size_t i;
+	struct hm_table *t =
+		internal_hm_lookup(h, key, internal_hm_hash(h, key), &i);
+	return t ? t->slots[i].pair.v : NULL;
+}
+
+/* Find the entry for key, adding one with a NULL value if it's
+ * missing. Returns NULL only when the table couldn't grow. */
+static struct map_pair *
+internal_hm_entry(hashmap *h, void *key, uint64_t hash, bool *inserted)
+{
+	internal_hm_migrate(h, MIGRATE_GROUPS);
+
+	size_t i;
+	struct hm_table *t = internal_hm_lookup(h, key, hash, &i);
+	*inserted = !t;
+	if (t)
+		return &t->slots[i].pair;
+
+	if (h->cur.growth_left == 0)
+	{
+		/* resizes always leave room to finish migrating */
+		assert(!h->old.ctrl);
+		/* if tombstones are what filled the table, then
+		 * rehashing at the same size is enough to clear them */
+		size_t c = h->cur.capacity;
+		if (h->length >= internal_hm_max_load(c) / 2)
+		{
+			if (c > SIZE_MAX / 2)
+				return NULL;
+			c *= 2;
+		}
+		if (!internal_hm_resize(h, c))
+			return NULL;
+		internal_hm_migrate(h, MIGRATE_GROUPS);
+	}
+
+	i = internal_hm_place(&h->cur, (struct hm_slot){
+		.pair = {.k = key, .v = NULL}, .hash = hash
+	});
+	h->length++;
+	return &h->cur.slots[i].pair;
+}
+
+/* store val, destroying any value it replaces */
+static void
+internal_hm_set(hashmap *h, struct map_pair *p, bool inserted, void *val)
+{
+	if (!inserted && p->v != val && h->val_dtor)
+		h->val_dtor(p->v, h->dtor_aux);
+	p->v = val;
+}
+
+static bool
+internal_hm_insert(hashmap *h, void *key, void *val, uint64_t hash)
+{
+	bool inserted;
+	struct map_pair *p = internal_hm_entry(h, key, hash, &inserted);
+	if (!p)
+		return false;
+	internal_hm_set(h, p, inserted, val);
+	return true;
 }
 
 bool
@@ -143,24 +601,96 @@ hm_insert(hashmap *h, void *key, void *val)
 {
 	if (!h)
 		return false;
-	list *bucket = h->buckets[h->hash(key) % h->capacity];
-	list_item *li = l_find(bucket, key, internal_hm_cmp, h);
-	if (li)
+	return internal_hm_insert(h, key, val, internal_hm_hash(h, key));
+}
+
+void **
+hm_get_or_insert(hashmap *h, void *key, bool *inserted)
+{
+	if (!h)
+		return NULL;
+	bool ins;
+	struct map_pair *p =
+		internal_hm_entry(h, key, internal_hm_hash(h, key), &ins);
+	if (inserted)
+		*inserted = ins;
+	return p ? &p->v : NULL;
+}
+
+bool
+hm_update(hashmap *h, void *key, updater *fn, void *aux)
+{
+	if (!h || !fn)
+		return false;
+	bool inserted;
+	struct map_pair *p =
+		internal_hm_entry(h, key, internal_hm_hash(h, key), &inserted);
+	if (!p)
+		return false;
+	internal_hm_set(h, p, inserted, fn(inserted ? NULL : p->v, aux));
+	return true;
+}
+
+/* Hash a batch of keys and prefetch where each one lands before
+ * resolving any of them, so that the cache misses overlap rather
+ * than happening one after another. */
+static void
+internal_hm_prefetch_batch(const hashmap *h, void *const keys[],
+                           size_t n, uint64_t hashes[])
+{
+	size_t mask = internal_hm_groups(h->cur.capacity) - 1;
+	for (size_t j = 0; j < n; j++)
 	{
-		struct map_pair *p = (struct map_pair*)li->data;
-		if (p->v != val && h->val_dtor)
-			h->val_dtor(p->v, h->dtor_aux);
-		p->v = val;
+		hashes[j] = internal_hm_hash(h, keys[j]);
+		size_t g = H1(hashes[j]) & mask;
+		PREFETCH(h->cur.ctrl + g*GROUP_WIDTH);
+		PREFETCH(h->cur.slots + g*GROUP_WIDTH);
 	}
-	else
+}
+
+size_t
+hm_at_many(const hashmap *h, void *const keys[], size_t n,
+           void *vals[])
+{
+	if (!h || !keys || !vals)
+		return 0;
+	uint64_t hashes[BATCH_LEN];
+	size_t found = 0;
+	for (size_t b = 0; b < n; b += BATCH_LEN)
 	{
-		struct map_pair *p = internal_malloc(sizeof *p);
-		if (!p)
-			return false;
-		*p = (struct map_pair){.k = key, .v = val};
-		l_append(bucket, p);
+		size_t len = n-b < BATCH_LEN ? n-b : BATCH_LEN;
+		internal_hm_prefetch_batch(h, keys+b, len, hashes);
+		for (size_t j = 0; j < len; j++)
+		{
+			size_t i;
+			struct hm_table *t =
+				internal_hm_lookup(h, keys[b+j], hashes[j], &i);
+			vals[b+j] = t ? t->slots[i].pair.v : NULL;
+			if (t)
+				found++;
+		}
 	}
-	return true;
+	return found;
+}
+
+size_t
+hm_insert_many(hashmap *h, void *const keys[], void *const vals[],
+               size_t n)
+{
+	if (!h || !keys || !vals)
+		return 0;
+	uint64_t hashes[BATCH_LEN];
+	for (size_t b = 0; b < n; b += BATCH_LEN)
+	{
+		size_t len = n-b < BATCH_LEN ? n-b : BATCH_LEN;
+		/* a resize partway through only makes the
+		 * prefetches useless, not wrong */
+		internal_hm_prefetch_batch(h, keys+b, len, hashes);
+		for (size_t j = 0; j < len; j++)
+			if (!internal_hm_insert(h, keys[b+j], vals[b+j], hashes[j]))
+				return b+j;
+	}
+	return n;
 }
 
 bool
@@ -168,12 +698,30 @@ hm_remove(hashmap *h, void *key)
 {
 	if (!h)
 		return false;
-	list *bucket = h->buckets[h->hash(key) % h->capacity];
-	list_item *li = l_find(bucket, key, internal_hm_cmp, h);
-	if (!li)
+	internal_hm_migrate(h, MIGRATE_GROUPS);
+
+	size_t i;
+	struct hm_table *t =
+		internal_hm_lookup(h, key, internal_hm_hash(h, key), &i);
+	if (!t)
 		return false;
-	internal_hm_free_pair(li->data, h);
-	l_remove(bucket, li);
+	internal_hm_free_pair(h, &t->slots[i].pair);
+
+	/* A group that still has an empty slot never caused a probe to
+	 * continue past it, so nothing depends on this slot staying
+	 * occupied. Otherwise leave a tombstone. */
+	const unsigned char *group =
+		t->ctrl + (i / GROUP_WIDTH) * GROUP_WIDTH;
+	if (internal_match(group, CTRL_EMPTY))
+	{
+		t->ctrl[i] = CTRL_EMPTY;
+		t->growth_left++;
+	}
+	else
+		t->ctrl[i] = CTRL_DELETED;
+	h->length--;
+
+	internal_hm_maybe_shrink(h);
 	return true;
 }
 
@@ -182,8 +730,32 @@ hm_clear(hashmap *h)
 {
 	if (!h)
 		return;
-	for (size_t i = 0; i < h->capacity; i++)
-		l_clear(h->buckets[i]);
+	internal_hm_free_table(h, &h->old);
+	h->migrated = 0;
+	h->length = 0;
+
+	struct hm_table t;
+	if (h->cur.capacity > h->min_capacity &&
+	    internal_hm_alloc(&t, h->min_capacity))
+	{
+		internal_hm_free_table(h, &h->cur);
+		h->cur = t;
+		return;
+	}
+	if (h->key_dtor || h->val_dtor)
+		for (size_t i = 0; i < h->cur.capacity; i++)
+			if (CTRL_IS_FULL(h->cur.ctrl[i]))
+				internal_hm_free_pair(h, &h->cur.slots[i].pair);
+	memset(h->cur.ctrl, CTRL_EMPTY, h->cur.capacity);
+	h->cur.growth_left = internal_hm_max_load(h->cur.capacity);
+}
+
+/* the slot counts through the old table, then the current one */
+void
+hm_iter_init(hm_iter *i, hashmap *h)
+{
+	if (i)
+		*i = (hm_iter){.h = h};
 }
 
 hm_iter *
@@ -192,24 +764,29 @@ hm_iter_begin(hashmap *h)
 	if (!h)
 		return NULL;
 	hm_iter *i = internal_malloc(sizeof *i);
-	if (!i)
-		return NULL;
-	*i = (hm_iter){.h = h};
+	hm_iter_init(i, h);
 	return i;
 }
 
 struct map_pair *
 hm_iter_next(hm_iter *i)
 {
-	if (!i)
+	if (!i || !i->h)
 		return NULL;
-	while (!i->offset && i->bucket < i->h->capacity)
-		i->offset = l_first(i->h->buckets[i->bucket++]);
-	if (!i->offset)
-		return NULL;
-	struct map_pair *p = i->offset->data;
-	i->offset = i->offset->next;
-	return p;
+	const struct hm_table *old = &i->h->old, *cur = &i->h->cur;
+	while (i->slot < old->capacity)
+	{
+		size_t s = i->slot++;
+		if (CTRL_IS_FULL(old->ctrl[s]))
+			return &old->slots[s].pair;
+	}
+	while (i->slot - old->capacity < cur->capacity)
+	{
+		size_t s = i->slot++ - old->capacity;
+		if (CTRL_IS_FULL(cur->ctrl[s]))
+			return &cur->slots[s].pair;
+	}
+	return NULL;
 }
 
 void
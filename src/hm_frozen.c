@@ -0,0 +1,433 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "internal/alloc.h"
+#include "derp/hm_frozen.h"
+
+/* Hash and displace, after CHD (Belazzougui, Botelho and
+ * Dietzfelbinger, 2009):
+ *
+ * Keys hash into buckets of about LAMBDA keys each. Buckets are
+ * placed largest first, each trying displacements d = 0, 1, ...
+ * until every key in it lands on a free slot at
+ *
+ *     remix(hash ^ d*GOLDEN), scaled into [0, n)
+ *
+ * The winning d per bucket is all a lookup needs to find the slot
+ * again, and there are exactly as many slots as keys. CHD proper
+ * walks (f1 + d0*f2 + d1) mod n instead, but when n has many small
+ * factors those steps cycle through a fraction of the table and the
+ * last few buckets take ages to place.
+ *
+ * File layout:
+ *
+ *     struct frz_header
+ *     uint32_t displacements[buckets], padded to eight bytes
+ *     struct frz_slot [length]
+ *     key and value bytes, each followed by a NUL
+ *
+ * Slots locate their bytes by offset from the start of the file, so
+ * the mapping works at whatever address it lands. */
+
+#define FRZ_MAGIC "DERPFRZ"
+#define FRZ_VERSION 1
+#define FRZ_BYTE_ORDER UINT32_C(0x01020304)
+#define LAMBDA 4
+#define GOLDEN UINT64_C(0x9e3779b97f4a7c15)
+/* seeds to try before giving up, and displacements to try for a
+ * bucket before moving to the next seed */
+#define MAX_SEEDS 16
+#define MAX_DISPLACEMENTS (UINT32_C(1) << 24)
+
+struct frz_header
+{
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t version;
+	uint64_t seed;
+	uint64_t length;
+	uint64_t buckets;
+	uint64_t size; /* of the whole file */
+};
+
+struct frz_slot
+{
+	uint64_t hash;
+	uint64_t key_off, val_off;
+	uint32_t key_len, val_len;
+};
+
+struct hm_frozen
+{
+	const unsigned char *base;
+	size_t size;
+	uint64_t seed, length, buckets;
+	const uint32_t *disp;
+	const struct frz_slot *slots;
+};
+
+/* a pair on its way into the file */
+struct frz_item
+{
+	const void *k, *v;
+	uint32_t klen, vlen;
+	uint64_t hash;
+};
+
+/* where the slots start */
+static uint64_t
+internal_frz_slots_off(uint64_t buckets)
+{
+	return sizeof(struct frz_header) +
+	       ((buckets * sizeof(uint32_t) + 7) & ~(uint64_t)7);
+}
+
+/* MurmurHash3's finalizer */
+static uint64_t
+internal_frz_remix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= UINT64_C(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= UINT64_C(0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
+	return h;
+}
+
+/* Lemire's multiply-shift reduction of 32 bits into [0, n), which
+ * skips the division that % would cost. n is at most 2^32 */
+static uint64_t
+internal_frz_reduce(uint64_t x, uint64_t n)
+{
+	return ((x & 0xffffffff) * n) >> 32;
+}
+
+static uint64_t
+internal_frz_bucket(uint64_t hash, uint64_t buckets)
+{
+	return internal_frz_reduce(hash, buckets);
+}
+
+static uint64_t
+internal_frz_position(uint64_t hash, uint32_t d, uint64_t n)
+{
+	return internal_frz_reduce(
+		internal_frz_remix(hash ^ d * GOLDEN) >> 32, n);
+}
+
+/* find a displacement for every bucket and the slot for every item,
+ * false if some bucket won't fit under this seed */
+static bool
+internal_frz_place(const struct frz_item *items, uint64_t n, uint64_t nb,
+                   uint32_t *disp, uint64_t *pos)
+{
+	bool ok = false;
+	size_t i, j, b, most = 0;
+	size_t *start   = internal_malloc((nb+1) * sizeof *start),
+	       *members = internal_malloc(n * sizeof *members),
+	       *order   = internal_malloc(nb * sizeof *order),
+	       *by_size = NULL;
+	uint64_t *tried = NULL;
+	unsigned char *taken = internal_malloc(n);
+	if (!start || !members || !order || !taken)
+		goto done;
+	memset(taken, 0, n);
+
+	/* group items by bucket */
+	memset(start, 0, (nb+1) * sizeof *start);
+	for (i = 0; i < n; i++)
+		start[internal_frz_bucket(items[i].hash, nb) + 1]++;
+	for (b = 0; b < nb; b++)
+	{
+		if (start[b+1] > most)
+			most = start[b+1];
+		start[b+1] += start[b];
+	}
+	for (i = 0; i < n; i++)
+		members[start[internal_frz_bucket(items[i].hash, nb)]++] = i;
+	/* each start[b] now points past bucket b, so shift them back */
+	for (b = nb; b > 0; b--)
+		start[b] = start[b-1];
+	start[0] = 0;
+
+	/* order buckets largest first, with a counting sort on size */
+	by_size = internal_malloc((most+2) * sizeof *by_size);
+	tried   = internal_malloc(most * sizeof *tried);
+	if (!by_size || !tried)
+		goto done;
+	memset(by_size, 0, (most+2) * sizeof *by_size);
+	for (b = 0; b < nb; b++)
+		by_size[most - (start[b+1] - start[b]) + 1]++;
+	for (i = 0; i <= most; i++)
+		by_size[i+1] += by_size[i];
+	for (b = 0; b < nb; b++)
+		order[by_size[most - (start[b+1] - start[b])]++] = b;
+
+	for (size_t o = 0; o < nb; o++)
+	{
+		b = order[o];
+		size_t size = start[b+1] - start[b];
+		if (size == 0)
+			break; /* the rest are empty too */
+		const size_t *m = members + start[b];
+		for (i = 0; i < size; i++)
+			for (j = 0; j < i; j++)
+				if (items[m[i]].hash == items[m[j]].hash)
+					goto done; /* inseparable, try another seed */
+
+		uint32_t d;
+		for (d = 0; d < MAX_DISPLACEMENTS; d++)
+		{
+			for (i = 0; i < size; i++)
+			{
+				tried[i] = internal_frz_position(items[m[i]].hash, d, n);
+				if (taken[tried[i]])
+					break;
+				taken[tried[i]] = 1;
+			}
+			if (i == size)
+			{
+				disp[b] = d;
+				for (i = 0; i < size; i++)
+					pos[m[i]] = tried[i];
+				break;
+			}
+			while (i-- > 0)
+				taken[tried[i]] = 0;
+		}
+		if (d == MAX_DISPLACEMENTS)
+			goto done;
+	}
+	ok = true;
+done:
+	internal_free(start);
+	internal_free(members);
+	internal_free(order);
+	internal_free(by_size);
+	internal_free(tried);
+	internal_free(taken);
+	return ok;
+}
+
+static bool
+internal_frz_write(FILE *f, const void *p, size_t len)
+{
+	return len == 0 || fwrite(p, 1, len, f) == len;
+}
+
+size_t
+hm_bytes_str(const void *s, const void **bytes, void *aux)
+{
+	(void)aux;
+	*bytes = s ? s : "";
+	return strlen(*bytes);
+}
+
+bool
+hm_freeze(hashmap *h, const char *path,
+          hm_bytes *key_bytes, hm_bytes *val_bytes, void *aux)
+{
+	if (!h || !path)
+		return false;
+	if (!key_bytes)
+		key_bytes = hm_bytes_str;
+	if (!val_bytes)
+		val_bytes = hm_bytes_str;
+	uint64_t n = hm_length(h);
+	if (n > UINT32_MAX)
+		return false;
+	uint64_t i, nb = (n + LAMBDA - 1) / LAMBDA;
+
+	bool ok = false;
+	FILE *f = NULL;
+	size_t pathlen = strlen(path);
+	char *tmp = internal_malloc(pathlen + sizeof ".tmp");
+	/* never ask for zero bytes, which may come back NULL */
+	struct frz_item *items = internal_malloc((n+1) * sizeof *items);
+	uint32_t *disp         = internal_malloc((nb+2) * sizeof *disp);
+	struct frz_slot *slots = internal_malloc((n+1) * sizeof *slots);
+	uint64_t *pos          = internal_malloc((n+1) * sizeof *pos);
+	if (!tmp || !items || !disp || !slots || !pos)
+		goto done;
+
+	hm_iter it;
+	struct map_pair *p;
+	hm_iter_init(&it, h);
+	for (i = 0; (p = hm_iter_next(&it)); i++)
+	{
+		size_t klen = key_bytes(p->k, &items[i].k, aux),
+		       vlen = val_bytes(p->v, &items[i].v, aux);
+		if (klen > UINT32_MAX || vlen > UINT32_MAX)
+			goto done;
+		items[i].klen = (uint32_t)klen;
+		items[i].vlen = (uint32_t)vlen;
+	}
+
+	uint64_t seed = derp_hash_seed();
+	int attempt;
+	for (attempt = 0; attempt < MAX_SEEDS; attempt++)
+	{
+		seed = derp_hash_bytes(&attempt, sizeof attempt, seed);
+		for (i = 0; i < n; i++)
+			items[i].hash = derp_hash_bytes(
+				items[i].k, items[i].klen, seed);
+		memset(disp, 0, (nb+2) * sizeof *disp);
+		if (n == 0 || internal_frz_place(items, n, nb, disp, pos))
+			break;
+	}
+	if (attempt == MAX_SEEDS)
+		goto done; /* duplicate keys, most likely */
+
+	uint64_t off = internal_frz_slots_off(nb) + n * sizeof *slots;
+	for (i = 0; i < n; i++)
+	{
+		slots[pos[i]] = (struct frz_slot){
+			.hash = items[i].hash,
+			.key_off = off,
+			.val_off = off + items[i].klen + 1,
+			.key_len = items[i].klen,
+			.val_len = items[i].vlen
+		};
+		off += items[i].klen + 1 + items[i].vlen + 1;
+	}
+	struct frz_header hdr = {
+		.magic = FRZ_MAGIC,
+		.byte_order = FRZ_BYTE_ORDER,
+		.version = FRZ_VERSION,
+		.seed = seed,
+		.length = n,
+		.buckets = nb,
+		.size = off
+	};
+
+	/* write beside the destination and rename over it, so processes
+	 * that already mapped the old file keep a consistent copy */
+	memcpy(tmp, path, pathlen);
+	memcpy(tmp + pathlen, ".tmp", sizeof ".tmp");
+	if (!(f = fopen(tmp, "wb")))
+		goto done;
+	bool wrote = internal_frz_write(f, &hdr, sizeof hdr) &&
+	             /* the padding after them comes from disp too */
+	             internal_frz_write(f, disp, internal_frz_slots_off(nb) -
+	                                sizeof hdr) &&
+	             internal_frz_write(f, slots, n * sizeof *slots);
+	for (i = 0; wrote && i < n; i++)
+		wrote = internal_frz_write(f, items[i].k, items[i].klen) &&
+		        internal_frz_write(f, "", 1) &&
+		        internal_frz_write(f, items[i].v, items[i].vlen) &&
+		        internal_frz_write(f, "", 1);
+	wrote = fclose(f) == 0 && wrote;
+	ok = wrote && rename(tmp, path) == 0;
+	if (!ok)
+		remove(tmp);
+done:
+	internal_free(tmp);
+	internal_free(items);
+	internal_free(disp);
+	internal_free(slots);
+	internal_free(pos);
+	return ok;
+}
+
+/* check what lookups rely on, everything but the slot offsets,
+ * which hm_frozen_at checks as it goes rather than touching every
+ * page up front */
+static bool
+internal_frz_valid(const struct frz_header *hdr, size_t size)
+{
+	if (size < sizeof *hdr ||
+	    memcmp(hdr->magic, FRZ_MAGIC, sizeof FRZ_MAGIC) != 0 ||
+	    hdr->byte_order != FRZ_BYTE_ORDER ||
+	    hdr->version != FRZ_VERSION ||
+	    hdr->size != size ||
+	    hdr->length > UINT32_MAX ||
+	    hdr->buckets > hdr->length ||
+	    (hdr->buckets == 0) != (hdr->length == 0))
+		return false;
+	return internal_frz_slots_off(hdr->buckets) +
+	       hdr->length * sizeof(struct frz_slot) <= size;
+}
+
+hm_frozen *
+hm_frozen_open(const char *path)
+{
+	if (!path)
+		return NULL;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	hm_frozen *f = NULL;
+	void *base = MAP_FAILED;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct frz_header))
+		goto done;
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		goto done;
+	const struct frz_header *hdr = base;
+	if (!internal_frz_valid(hdr, st.st_size) ||
+	    !(f = internal_malloc(sizeof *f)))
+	{
+		munmap(base, st.st_size);
+		goto done;
+	}
+	const unsigned char *b = base;
+	*f = (struct hm_frozen){
+		.base = b,
+		.size = st.st_size,
+		.seed = hdr->seed,
+		.length = hdr->length,
+		.buckets = hdr->buckets,
+		.disp = (const uint32_t *)(b + sizeof *hdr),
+		.slots = (const struct frz_slot *)
+			(b + internal_frz_slots_off(hdr->buckets))
+	};
+done:
+	/* the mapping outlives the descriptor */
+	close(fd);
+	return f;
+}
+
+void
+hm_frozen_close(hm_frozen *f)
+{
+	if (!f)
+		return;
+	munmap((void *)f->base, f->size);
+	internal_free(f);
+}
+
+size_t
+hm_frozen_length(const hm_frozen *f)
+{
+	return f ? f->length : 0;
+}
+
+const void *
+hm_frozen_at(const hm_frozen *f, const void *key, size_t keylen,
+             size_t *vallen)
+{
+	if (!f || f->length == 0 || (!key && keylen))
+		return NULL;
+	uint64_t hash = derp_hash_bytes(key, keylen, f->seed);
+	const struct frz_slot *s = f->slots + internal_frz_position(
+		hash, f->disp[internal_frz_bucket(hash, f->buckets)], f->length);
+	if (s->hash != hash || s->key_len != keylen)
+		return NULL;
+	/* the file could be damaged, so stay inside the mapping */
+	if (s->key_off > f->size || keylen > f->size - s->key_off ||
+	    s->val_off >= f->size || s->val_len >= f->size - s->val_off)
+		return NULL;
+	if (keylen && memcmp(f->base + s->key_off, key, keylen) != 0)
+		return NULL;
+	if (vallen)
+		*vallen = s->val_len;
+	return f->base + s->val_off;
+}
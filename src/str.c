@@ -0,0 +1,100 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "internal/alloc.h"
+#include "derp/str.h"
+
+static bool
+internal_str_is_inline(size_t len)
+{
+	return len < DERP_STR_INLINE;
+}
+
+void
+derp_str_init(derp_str *s, const char *bytes, size_t len)
+{
+	if (!s)
+		return;
+	s->len = len;
+	s->hash = derp_hash_bytes(bytes, len, derp_hash_seed());
+	if (internal_str_is_inline(len))
+	{
+		memcpy(s->data.buf, bytes, len);
+		s->data.buf[len] = '\0';
+	}
+	else
+		s->data.ptr = bytes;
+}
+
+derp_str *
+derp_str_new(const char *bytes, size_t len)
+{
+	/* long strings keep their bytes in the same allocation */
+	size_t extra = internal_str_is_inline(len) ? 0 : len + 1;
+	if (extra > SIZE_MAX - sizeof(derp_str))
+		return NULL;
+	derp_str *s = internal_malloc(sizeof *s + extra);
+	if (!s)
+		return NULL;
+	if (extra)
+	{
+		char *copy = (char *)(s + 1);
+		memcpy(copy, bytes, len);
+		copy[len] = '\0';
+		bytes = copy;
+	}
+	derp_str_init(s, bytes, len);
+	return s;
+}
+
+const char *
+derp_str_data(const derp_str *s)
+{
+	if (!s)
+		return NULL;
+	return internal_str_is_inline(s->len) ? s->data.buf : s->data.ptr;
+}
+
+size_t
+derp_str_len(const derp_str *s)
+{
+	return s ? s->len : 0;
+}
+
+void
+derp_str_free(void *s, void *aux)
+{
+	(void)aux;
+	internal_free(s);
+}
+
+unsigned long
+derp_str_hash(const void *s)
+{
+	return ((const derp_str *)s)->hash;
+}
+
+int
+derp_str_cmp(const void *a, const void *b, void *aux)
+{
+	(void)aux;
+	const derp_str *x = a, *y = b;
+	if (x == y)
+		return 0;
+	size_t n = x->len < y->len ? x->len : y->len;
+	int c = memcmp(derp_str_data(x), derp_str_data(y), n);
+	if (c != 0)
+		return c;
+	return (x->len > y->len) - (x->len < y->len);
+}
+
+int
+derp_str_eq(const void *a, const void *b, void *aux)
+{
+	(void)aux;
+	const derp_str *x = a, *y = b;
+	if (x->len != y->len || x->hash != y->hash)
+		return 1;
+	return memcmp(derp_str_data(x), derp_str_data(y), x->len);
+}
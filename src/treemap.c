@@ -1,25 +1,94 @@
+#include <assert.h>
+
 #include "internal/alloc.h"
-#include "derp/list.h"
+#include "internal/btree.h"
 #include "derp/treemap.h"
 
+#if defined(__GNUC__)
+	#include "internal/atomic.h"
+#endif
+
 /* AA (Arne Andersson) Tree:
  * Balanced Search Trees Made Simple
  * https://user.it.uu.se/~arnea/ps/simp.pdf
  *
  * As fast as an RB-tree, but free of those
- * ugly special cases. */
+ * ugly special cases.
+ *
+ * Trees made by tm_new_btree keep their pairs in a B+ tree instead,
+ * see btree.c, and every function here hands off to it.
+ *
+ * Snapshots share nodes with the tree. Each node counts the pointers
+ * to it, from parents or as a root, and a write copies any node whose
+ * count says somebody else can see it before changing it, starting
+ * from the root. So a node the tree changes in place is one no
+ * snapshot can reach, and the nodes snapshots reach never change. */
 
 struct tm_node
 {
-	int level;
-	struct map_pair *pair;
+	int level; /* 0 only for the sentinel and free nodes */
+	unsigned refs;
+	size_t size; /* nodes in this subtree, for rank and select */
+	struct map_pair pair;
 	struct tm_node *left, *right;
 };
 
+/* Nodes come from slabs owned by the tree, so an insert costs no
+ * malloc most of the time. Removed nodes go on a free list threaded
+ * through their left pointers, and clearing the tree frees whole
+ * slabs rather than one node at a time.
+ *
+ * The slabs, sentinel and free lists make up a pool, which a tree
+ * shares with its snapshots and which lasts until they're all freed.
+ * Only the tree takes nodes from the pool. Snapshots can be freed on
+ * any thread, so nodes they let go of wait on a separate stack until
+ * the tree runs short.
+ *
+ * Keys and values the tree lets go of while snapshots might still see
+ * them wait on the retired list, in nodes that aren't in any tree:
+ * the pair in pair, which halves of it to destroy in size, and the
+ * next one in left. Clearing retires the whole old tree in one node,
+ * with its root in right. The tree destroys them on a write that
+ * finds it no longer shares the pool, and if the tree is freed first,
+ * the last snapshot freed destroys them along with the tree's last
+ * pairs. */
+
+#define SLAB_MIN 32
+#define SLAB_MAX 4096
+
+struct tm_slab
+{
+	struct tm_slab *next;
+	size_t capacity, used;
+	struct tm_node nodes[];
+};
+
+enum { TM_DROP_KEY = 1, TM_DROP_VAL = 2, TM_DROP_TREE = 4 };
+
+struct tm_pool
+{
+	unsigned refs;
+	struct tm_node bottom;
+	struct tm_slab *slabs; /* newest first */
+	struct tm_node *free_nodes;
+	size_t nfree;
+	struct tm_node *returned;
+	struct tm_node *retired;
+	/* what a tree freed before its snapshots left for them */
+	struct tm_node *orphan;
+	dtor *key_dtor;
+	dtor *val_dtor;
+	void *dtor_aux;
+};
+
 struct treemap
 {
 	struct tm_node *root, *bottom;
-	struct tm_node *deleted, *last;
+	struct tm_node *min, *max; /* the bottom when empty */
+	struct btree *bt; /* NULL for an AA tree */
+	struct tm_pool *pool;
+	bool snapshot;
+	bool cow; /* whether the write in progress copies shared nodes */
 
 	dtor *key_dtor;
 	dtor *val_dtor;
@@ -28,73 +97,387 @@ struct treemap
 	void *dtor_aux;
 };
 
-struct tm_iter
+static int
+internal_tm_log2(size_t n)
 {
-	list *stack;
-	struct tm_node *n, *bottom;
-};
+	int bits = 0;
+	while (n >>= 1)
+		bits++;
+	return bits;
+}
+
+static struct tm_node *
+internal_tm_slab_alloc(struct tm_pool *pool)
+{
+	struct tm_slab *s = pool->slabs;
+	if (!s || s->used == s->capacity)
+	{
+		/* grow geometrically, so small trees stay small */
+		size_t cap = s ? 2 * s->capacity : SLAB_MIN;
+		if (cap > SLAB_MAX)
+			cap = SLAB_MAX;
+		s = internal_malloc(sizeof *s + cap * sizeof *s->nodes);
+		if (!s)
+			return NULL;
+		*s = (struct tm_slab){
+			.next = pool->slabs, .capacity = cap, .used = 0
+		};
+		pool->slabs = s;
+	}
+	return &s->nodes[s->used++];
+}
+
+static void
+internal_tm_node_free(struct tm_pool *pool, struct tm_node *n)
+{
+	n->level = 0;
+	n->left = pool->free_nodes;
+	pool->free_nodes = n;
+	pool->nfree++;
+}
+
+/* move nodes that snapshots gave back onto the free list */
+static void
+internal_tm_reclaim(struct tm_pool *pool)
+{
+#if defined(__GNUC__)
+	struct tm_node *n = ATOMIC_EXCHANGE(&pool->returned, NULL), *next;
+#else
+	struct tm_node *n = pool->returned, *next;
+	pool->returned = NULL;
+#endif
+	for (; n; n = next)
+	{
+		next = n->left;
+		internal_tm_node_free(pool, n);
+	}
+}
+
+static struct tm_node *
+internal_tm_node_alloc(treemap *t)
+{
+	struct tm_pool *pool = t->pool;
+	if (!pool->free_nodes)
+		internal_tm_reclaim(pool);
+	struct tm_node *n = pool->free_nodes;
+	if (!n)
+		return internal_tm_slab_alloc(pool);
+	pool->free_nodes = n->left;
+	pool->nfree--;
+	return n;
+}
+
+/* put n nodes on the free list, so taking them can't fail */
+static bool
+internal_tm_reserve(treemap *t, size_t n)
+{
+	struct tm_pool *pool = t->pool;
+	if (pool->nfree < n)
+		internal_tm_reclaim(pool);
+	while (pool->nfree < n)
+	{
+		struct tm_node *node = internal_tm_slab_alloc(pool);
+		if (!node)
+			return false;
+		internal_tm_node_free(pool, node);
+	}
+	return true;
+}
+
+static void
+internal_tm_ref(struct tm_pool *pool, struct tm_node *n)
+{
+	if (n == &pool->bottom)
+		return;
+#if defined(__GNUC__)
+	ATOMIC_FETCH_ADD(&n->refs, 1);
+#else
+	n->refs++;
+#endif
+}
+
+/* Drop a reference to n, and free whatever only it kept alive. Any
+ * thread may do this, so freed nodes go on the returned stack. */
+static void
+internal_tm_release(struct tm_pool *pool, struct tm_node *n)
+{
+	/* holds the right siblings still to do along one path */
+	struct tm_node *stack[TM_ITER_MAX_DEPTH + 2];
+	size_t depth = 0;
+	stack[depth++] = n;
+	while (depth > 0)
+	{
+		n = stack[--depth];
+		if (n == &pool->bottom)
+			continue;
+#if defined(__GNUC__)
+		if (ATOMIC_FETCH_SUB(&n->refs, 1) > 1)
+			continue;
+#else
+		if (n->refs-- > 1)
+			continue;
+#endif
+		assert(depth + 2 <= sizeof stack / sizeof *stack);
+		stack[depth++] = n->right;
+		stack[depth++] = n->left;
+		n->level = 0;
+#if defined(__GNUC__)
+		struct tm_node *head = ATOMIC_LOAD(&pool->returned);
+		do
+			n->left = head;
+		while (!ATOMIC_CAS(&pool->returned, &head, n));
+#else
+		n->left = pool->returned;
+		pool->returned = n;
+#endif
+	}
+}
+
+/* Run the destructors on the pairs in subtree n */
+static void
+internal_tm_destroy_tree(struct tm_pool *pool, struct tm_node *n,
+                         dtor *key_dtor, dtor *val_dtor, void *aux)
+{
+	struct tm_node *stack[TM_ITER_MAX_DEPTH + 2];
+	size_t depth = 0;
+	stack[depth++] = n;
+	while (depth > 0)
+	{
+		n = stack[--depth];
+		if (n == &pool->bottom)
+			continue;
+		assert(depth + 2 <= sizeof stack / sizeof *stack);
+		stack[depth++] = n->right;
+		stack[depth++] = n->left;
+		if (key_dtor)
+			key_dtor(n->pair.k, aux);
+		if (val_dtor)
+			val_dtor(n->pair.v, aux);
+	}
+}
+
+/* destroy everything on the retired list, once no snapshot can see it */
+static void
+internal_tm_drain(struct tm_pool *pool,
+                  dtor *key_dtor, dtor *val_dtor, void *aux)
+{
+	struct tm_node *r = pool->retired, *next;
+	pool->retired = NULL;
+	for (; r; r = next)
+	{
+		next = r->left;
+		if (r->size & TM_DROP_TREE)
+		{
+			internal_tm_destroy_tree(pool, r->right,
+			                         key_dtor, val_dtor, aux);
+			internal_tm_release(pool, r->right);
+		}
+		if ((r->size & TM_DROP_KEY) && key_dtor)
+			key_dtor(r->pair.k, aux);
+		if ((r->size & TM_DROP_VAL) && val_dtor)
+			val_dtor(r->pair.v, aux);
+		internal_tm_node_free(pool, r);
+	}
+}
+
+static bool
+internal_tm_shared(const treemap *t)
+{
+#if defined(__GNUC__)
+	return ATOMIC_LOAD(&t->pool->refs) > 1;
+#else
+	return t->pool->refs > 1;
+#endif
+}
+
+/* Snapshots share nodes only while they share the pool, and only the
+ * writer makes snapshots, so a write checks for them once up front
+ * and skips looking at reference counts when there are none */
+static bool
+internal_tm_begin(treemap *t)
+{
+	t->cow = internal_tm_shared(t);
+	if (!t->cow && t->pool->retired)
+		internal_tm_drain(t->pool, t->key_dtor, t->val_dtor, t->dtor_aux);
+	return t->cow;
+}
+
+/* All a single insert or remove in a tree of size nodes could take:
+ * its new node, and while there are snapshots, copies of what it
+ * touches and a node to retire the pair it drops. That's the path
+ * down plus a few nodes per level for rebalancing. */
+static size_t
+internal_tm_write_cost(const treemap *t, size_t size)
+{
+	size_t need = 1;
+	if (t->cow)
+		need += 8 * (2 * internal_tm_log2(size + 1) + 2) + 1;
+	return need;
+}
+
+static bool
+internal_tm_prepare(treemap *t)
+{
+	internal_tm_begin(t);
+	return internal_tm_reserve(t, internal_tm_write_cost(t, t->root->size));
+}
+
+/* Make *link safe to change, replacing a node that snapshots can see
+ * with a private copy. The node holding link must already be safe to
+ * change, and internal_tm_prepare must have run. */
+static struct tm_node *
+internal_tm_own(treemap *t, struct tm_node **link)
+{
+	struct tm_node *n = *link;
+	if (!t->cow || n == t->bottom)
+		return n;
+#if defined(__GNUC__)
+	if (ATOMIC_LOAD(&n->refs) == 1)
+		return n;
+#else
+	if (n->refs == 1)
+		return n;
+#endif
+	struct tm_node *copy = internal_tm_node_alloc(t);
+	assert(copy);
+	/* field by field, since other threads may be changing refs */
+	*copy = (struct tm_node){
+		.level = n->level, .refs = 1, .size = n->size, .pair = n->pair,
+		.left = n->left, .right = n->right
+	};
+	internal_tm_ref(t->pool, n->left);
+	internal_tm_ref(t->pool, n->right);
+	internal_tm_release(t->pool, n);
+	return *link = copy;
+}
+
+static void
+internal_tm_pool_drop(struct tm_pool *pool)
+{
+#if defined(__GNUC__)
+	if (ATOMIC_FETCH_SUB(&pool->refs, 1) > 1)
+		return;
+#else
+	if (pool->refs-- > 1)
+		return;
+#endif
+	internal_tm_drain(pool, pool->key_dtor, pool->val_dtor, pool->dtor_aux);
+	if (pool->orphan)
+		internal_tm_destroy_tree(pool, pool->orphan, pool->key_dtor,
+		                         pool->val_dtor, pool->dtor_aux);
+	struct tm_slab *s, *next;
+	for (s = pool->slabs; s; s = next)
+	{
+		next = s->next;
+		internal_free(s);
+	}
+	internal_free(pool);
+}
 
 treemap *
 tm_new(comparator *cmp, void *cmp_aux)
 {
 	treemap *t = internal_malloc(sizeof *t);
-	struct tm_node *bottom = internal_malloc(sizeof *bottom);
-	if (!t || !bottom)
+	struct tm_pool *pool = internal_malloc(sizeof *pool);
+	if (!t || !pool)
 	{
 		internal_free(t);
-		internal_free(bottom);
+		internal_free(pool);
 		return NULL;
 	}
+	*pool = (struct tm_pool){.refs = 1};
 	/* sentinel living below all leaves */
+	struct tm_node *bottom = &pool->bottom;
 	*bottom = (struct tm_node){
 		.left = bottom, .right = bottom, .level = 0
 	};
 	*t = (treemap){
 		.root = bottom,
 		.bottom = bottom,
-		.deleted = bottom,
-		.last = bottom,
+		.min = bottom,
+		.max = bottom,
+		.pool = pool,
 		.cmp = cmp,
 		.cmp_aux = cmp_aux
 	};
 	return t;
 }
 
+treemap *
+tm_new_btree(comparator *cmp, void *cmp_aux)
+{
+	treemap *t = tm_new(cmp, cmp_aux);
+	if (!t)
+		return NULL;
+	if (!(t->bt = internal_bt_new(cmp, cmp_aux)))
+	{
+		tm_free(t);
+		return NULL;
+	}
+	return t;
+}
+
 void
 tm_free(treemap *t)
 {
 	if (!t)
 		return;
-	tm_clear(t);
-	internal_free(t->bottom);
+	if (t->snapshot)
+		internal_tm_release(t->pool, t->root);
+	else if (!t->bt && internal_tm_begin(t))
+	{
+		/* leave the pairs to the last snapshot */
+		struct tm_pool *pool = t->pool;
+		pool->orphan = t->root;
+		pool->key_dtor = t->key_dtor;
+		pool->val_dtor = t->val_dtor;
+		pool->dtor_aux = t->dtor_aux;
+	}
+	else
+		tm_clear(t);
+	internal_bt_free(t->bt, NULL, NULL, NULL);
+	internal_tm_pool_drop(t->pool);
 	internal_free(t);
 }
 
+treemap *
+tm_snapshot(const treemap *t)
+{
+	if (!t || t->bt)
+		return NULL;
+	treemap *s = internal_malloc(sizeof *s);
+	if (!s)
+		return NULL;
+	*s = *t;
+	s->snapshot = true;
+	s->key_dtor = s->val_dtor = NULL;
+#if defined(__GNUC__)
+	ATOMIC_FETCH_ADD(&t->pool->refs, 1);
+#else
+	t->pool->refs++;
+#endif
+	internal_tm_ref(t->pool, t->root);
+	return s;
+}
+
 void
 tm_dtor(treemap *t, dtor *key_dtor, dtor *val_dtor, void *dtor_aux)
 {
-	if (!t)
+	if (!t || t->snapshot)
 		return;
 	t->key_dtor = key_dtor;
 	t->val_dtor = val_dtor;
 	t->dtor_aux = dtor_aux;
 }
 
-static size_t
-internal_tm_length(const struct tm_node *n,
-                   const struct tm_node *bottom)
-{
-	if (n == bottom)
-		return 0;
-	return 1 +
-		internal_tm_length(n->left, bottom) +
-		internal_tm_length(n->right, bottom);
-}
-
 size_t
 tm_length(const treemap *t)
 {
-	return t ? internal_tm_length(t->root, t->bottom) : 0;
+	if (!t)
+		return 0;
+	if (t->bt)
+		return internal_bt_length(t->bt);
+	return t->root->size; /* the sentinel's size stays 0 */
 }
 
 bool
@@ -103,179 +486,979 @@ tm_is_empty(const treemap *t)
 	return tm_length(t) == 0;
 }
 
-static void *
-internal_tm_at(const treemap *t, const struct tm_node *n,
-               const void *key)
+static struct tm_node *
+internal_tm_find(const treemap *t, const void *key)
 {
-	if (n == t->bottom)
-		return NULL;
-	int x = t->cmp(key, n->pair->k, t->cmp_aux);
-	if (x == 0)
-		return n->pair->v;
-	else if (x < 0)
-		return internal_tm_at(t, n->left, key);
-	return internal_tm_at(t, n->right, key);
+	struct tm_node *n = t->root;
+	while (n != t->bottom)
+	{
+		int x = t->cmp(key, n->pair.k, t->cmp_aux);
+		if (x == 0)
+			return n;
+		n = x < 0 ? n->left : n->right;
+	}
+	return NULL;
 }
 
 void *
 tm_at(const treemap *t, const void *key)
 {
-	return t ? internal_tm_at(t, t->root, key) : NULL;
+	if (!t)
+		return NULL;
+	if (t->bt)
+	{
+		struct map_pair *p = internal_bt_find(t->bt, key);
+		return p ? p->v : NULL;
+	}
+	struct tm_node *n = internal_tm_find(t, key);
+	return n ? n->pair.v : NULL;
 }
 
+/* For writes that could have moved or copied the end nodes */
+static void
+internal_tm_find_ends(treemap *t)
+{
+	struct tm_node *n;
+	for (n = t->min = t->root; n != t->bottom; n = n->left)
+		t->min = n;
+	for (n = t->max = t->root; n != t->bottom; n = n->right)
+		t->max = n;
+}
+
+static void
+internal_tm_resize(struct tm_node *n)
+{
+	n->size = 1 + n->left->size + n->right->size;
+}
+
+/* The sentinel's level matches its children's, but rotating it
+ * would corrupt its size and level */
+
+/* Both take a node that's safe to change, and copy the child they
+ * rotate up if a snapshot shares it */
+
 static struct tm_node *
-internal_tm_skew(struct tm_node *n) {
-	if (n->level != n->left->level)
+internal_tm_skew(treemap *t, struct tm_node *n) {
+	if (n->level == 0 || n->level != n->left->level)
 		return n;
-	struct tm_node *left = n->left;
+	struct tm_node *left = internal_tm_own(t, &n->left);
 	n->left = left->right;
 	left->right = n;
+	left->size = n->size;
+	internal_tm_resize(n);
 	n = left;
 	return n;
 }
 
 static struct tm_node *
-internal_tm_split(struct tm_node *n) {
-	if(n->right->right->level != n->level)
+internal_tm_split(treemap *t, struct tm_node *n) {
+	if (n->level == 0 || n->right->right->level != n->level)
 		return n;
-	struct tm_node *right = n->right;
+	struct tm_node *right = internal_tm_own(t, &n->right);
 	n->right = right->left;
 	right->left = n;
+	right->size = n->size;
+	internal_tm_resize(n);
 	n = right;
 	n->level++;
 	return n;
 }
 
+/* Writes below walk down with an explicit stack of the nodes they
+ * pass and which way they turned, owning each one, then walk back up
+ * it to rebalance. The height bound that sizes iterator stacks sizes
+ * these too. */
+
+struct tm_path
+{
+	struct tm_node *nodes[TM_ITER_MAX_DEPTH];
+	bool left[TM_ITER_MAX_DEPTH];
+	size_t depth;
+};
+
+static void
+internal_tm_push(struct tm_path *path, struct tm_node *n, bool left)
+{
+	assert(path->depth < TM_ITER_MAX_DEPTH);
+	path->nodes[path->depth] = n;
+	path->left[path->depth++] = left;
+}
+
+/* Hang n back where the top of the path pointed, fixing up each
+ * ancestor with fix, and make the result the root */
+static void
+internal_tm_unwind(treemap *t, struct tm_path *path, struct tm_node *n,
+                   struct tm_node *(*fix)(treemap *, struct tm_node *))
+{
+	while (path->depth-- > 0)
+	{
+		struct tm_node *p = path->nodes[path->depth];
+		if (path->left[path->depth])
+			p->left = n;
+		else
+			p->right = n;
+		internal_tm_resize(p);
+		n = fix(t, p);
+	}
+	t->root = n;
+}
+
 static struct tm_node *
-internal_tm_insert(treemap *t, struct tm_node *n,
-                   struct tm_node *prealloc)
-{
-	if (n == t->bottom)
-		return prealloc;
-	int x = t->cmp(prealloc->pair->k, n->pair->k, t->cmp_aux);
-	if (x < 0)
-		n->left = internal_tm_insert(t, n->left, prealloc);
-	else if (x > 0)
-		n->right = internal_tm_insert(t, n->right, prealloc);
-	else
+internal_tm_insert_fix(treemap *t, struct tm_node *n)
+{
+	return internal_tm_split(t, internal_tm_skew(t, n));
+}
+
+/* On finding key already present, leaves the tree alone and returns
+ * the existing node. The caller decides what to do with it, and with
+ * prealloc. */
+static struct tm_node *
+internal_tm_insert(treemap *t, struct tm_node *prealloc)
+{
+	struct tm_path path = {.depth = 0};
+	struct tm_node **link = &t->root, *n;
+	bool leftmost = true, rightmost = true;
+	while ((n = internal_tm_own(t, link)) != t->bottom)
 	{
-		/* prealloc was for naught, but we'll use its value */
-		if (n->pair->v != prealloc->pair->v && t->val_dtor)
-			t->val_dtor(n->pair->v, t->dtor_aux);
-		if (n->pair->k != prealloc->pair->k && t->key_dtor)
-			t->key_dtor(n->pair->k, t->dtor_aux);
-		*n->pair = *prealloc->pair;
-		internal_free(prealloc->pair);
-		internal_free(prealloc);
-		return n;
+		int x = t->cmp(prealloc->pair.k, n->pair.k, t->cmp_aux);
+		if (x == 0)
+		{
+			if (t->cow)
+				internal_tm_find_ends(t);
+			return n;
+		}
+		internal_tm_push(&path, n, x < 0);
+		link = x < 0 ? &n->left : &n->right;
+		if (x < 0)
+			rightmost = false;
+		else
+			leftmost = false;
 	}
-	return internal_tm_split(internal_tm_skew(n));
+	internal_tm_unwind(t, &path, prealloc, internal_tm_insert_fix);
+	/* rotations move nodes but not the pairs in them */
+	if (t->cow)
+		internal_tm_find_ends(t);
+	if (leftmost)
+		t->min = prealloc;
+	if (rightmost)
+		t->max = prealloc;
+	return NULL;
+}
+
+/* attempt the allocation before potentially splitting
+ * and skewing the tree, so the insertion can be a
+ * no-op on failure */
+static struct tm_node *
+internal_tm_prealloc(treemap *t, void *key, void *val)
+{
+	if (!internal_tm_prepare(t))
+		return NULL;
+	struct tm_node *prealloc = internal_tm_node_alloc(t);
+	*prealloc = (struct tm_node){
+		.level = 1, .refs = 1, .size = 1, .pair = {.k = key, .v = val},
+		.left = t->bottom, .right = t->bottom
+	};
+	return prealloc;
+}
+
+/* Destroy the halves of p in what that the tree lets go of, or retire
+ * them while snapshots share the tree. Writes reserve the node. */
+static void
+internal_tm_discard(treemap *t, struct map_pair p, unsigned what)
+{
+	if (!t->key_dtor)
+		what &= ~TM_DROP_KEY;
+	if (!t->val_dtor)
+		what &= ~TM_DROP_VAL;
+	if (!what)
+		return;
+	if (!t->cow)
+	{
+		if (what & TM_DROP_KEY)
+			t->key_dtor(p.k, t->dtor_aux);
+		if (what & TM_DROP_VAL)
+			t->val_dtor(p.v, t->dtor_aux);
+		return;
+	}
+	struct tm_node *r = internal_tm_node_alloc(t);
+	assert(r);
+	*r = (struct tm_node){
+		.size = what, .pair = p, .left = t->pool->retired
+	};
+	t->pool->retired = r;
+}
+
+/* what tm_insert does to a key that's already there */
+static void
+internal_tm_replace(treemap *t, struct map_pair *p, void *key, void *val)
+{
+	internal_tm_discard(t, *p, (p->k != key ? TM_DROP_KEY : 0) |
+	                           (p->v != val ? TM_DROP_VAL : 0));
+	*p = (struct map_pair){.k = key, .v = val};
+}
+
+static bool
+internal_tm_bt_insert(treemap *t, void *key, void *val)
+{
+	bool found;
+	void *old_key = key;
+	struct map_pair *p = internal_bt_insert(t->bt, key, &found, &old_key);
+	if (!p)
+		return false;
+	if (found)
+	{
+		/* the tree already adopted key */
+		p->k = old_key;
+		internal_tm_replace(t, p, key, val);
+	}
+	else
+		p->v = val;
+	return true;
 }
 
 bool
 tm_insert(treemap *t, void *key, void *val)
 {
-	if (!t)
+	if (!t || t->snapshot)
 		return false;
-	/* attempt the malloc before potentially splitting
-	 * and skewing the tree, so the insertion can be a
-	 * no-op on failure */
-	struct tm_node *prealloc = internal_malloc(sizeof *prealloc);
-	struct map_pair *p = internal_malloc(sizeof *p);
-	if (!prealloc || !p)
-	{
-		internal_free(prealloc);
-		internal_free(p);
+	if (t->bt)
+		return internal_tm_bt_insert(t, key, val);
+	struct tm_node *prealloc = internal_tm_prealloc(t, key, val), *found;
+	if (!prealloc)
 		return false;
+	found = internal_tm_insert(t, prealloc);
+	if (found)
+	{
+		/* prealloc was for naught, but we'll use its pair */
+		internal_tm_replace(t, &found->pair, key, val);
+		internal_tm_node_free(t->pool, prealloc);
 	}
-	*p = (struct map_pair){.k = key, .v = val};
-	*prealloc = (struct tm_node){
-		.level = 1, .pair = p, .left = t->bottom, .right = t->bottom
-	};
+	return true;
+}
 
-	t->root = internal_tm_insert(t, t->root, prealloc);
+void **
+tm_get_or_insert(treemap *t, void *key, bool *inserted)
+{
+	if (!t || t->snapshot)
+		return NULL;
+	if (t->bt)
+	{
+		bool found;
+		struct map_pair *p = internal_bt_insert(t->bt, key, &found, NULL);
+		if (p && inserted)
+			*inserted = !found;
+		return p ? &p->v : NULL;
+	}
+	struct tm_node *prealloc = internal_tm_prealloc(t, key, NULL), *found;
+	if (!prealloc)
+		return NULL;
+	found = internal_tm_insert(t, prealloc);
+	if (inserted)
+		*inserted = !found;
+	if (!found)
+		return &prealloc->pair.v;
+	internal_tm_node_free(t->pool, prealloc);
+	return &found->pair.v;
+}
+
+bool
+tm_update(treemap *t, void *key, updater *fn, void *aux)
+{
+	if (!fn)
+		return false;
+	bool inserted;
+	void **slot = tm_get_or_insert(t, key, &inserted);
+	if (!slot)
+		return false;
+	void *val = fn(inserted ? NULL : *slot, aux);
+	if (!inserted && *slot != val)
+		internal_tm_discard(t, (struct map_pair){.v = *slot}, TM_DROP_VAL);
+	*slot = val;
 	return true;
 }
 
+/* Bulk loading: lay the nodes out in order along their right
+ * pointers, then hang them into a tree of minimal height. */
+
+/* Rotate every left child up until the tree is a list through the
+ * right pointers, in order and ending at the sentinel */
 static struct tm_node *
-internal_tm_remove(treemap *t, struct tm_node *n, void *key)
+internal_tm_flatten(treemap *t)
 {
-	if (n == t->bottom)
-		return n;
+	struct tm_node **link = &t->root, *n;
+	while ((n = internal_tm_own(t, link)) != t->bottom)
+	{
+		if (n->left == t->bottom)
+			link = &n->right;
+		else
+		{
+			struct tm_node *l = internal_tm_own(t, &n->left);
+			n->left = l->right;
+			l->right = n;
+			*link = l;
+		}
+	}
+	return t->root;
+}
 
-	/* 1: search down the tree and set pointers last and deleted */
+/* Make a tree of the first size nodes in *list and advance *list past
+ * them. The left side gets the smaller half, and a subtree of s nodes
+ * has level log2(s+1), which leaves a right child on the same level
+ * only when the right half is one bigger and perfect. Recursion goes
+ * log2(size) deep. */
+static struct tm_node *
+internal_tm_build(treemap *t, struct tm_node **list, size_t size)
+{
+	if (size == 0)
+		return t->bottom;
+	size_t half = (size - 1) / 2;
+	struct tm_node *left = internal_tm_build(t, list, half),
+	               *n = *list;
+	*list = n->right;
+	n->left = left;
+	n->right = internal_tm_build(t, list, size - 1 - half);
+	n->size = size;
+	n->level = internal_tm_log2(size + 1);
+	return n;
+}
 
-	t->last = n;
-	if (t->cmp(key, n->pair->k, t->cmp_aux) < 0)
-		n->left = internal_tm_remove(t, n->left, key);
-	else
+/* B+ trees merge into fresh leaves instead */
+static bool
+internal_tm_bt_insert_sorted(treemap *t, const struct map_pair *pairs,
+                             size_t n)
+{
+	size_t had = internal_bt_length(t->bt), i = 0;
+	if (n * internal_tm_log2(had + n) < had)
+	{
+		for (; i < n; i++)
+			if (!internal_tm_bt_insert(t, pairs[i].k, pairs[i].v))
+				return false;
+		return true;
+	}
+	struct bt_build *b = internal_bt_build_begin(t->bt, had + n);
+	if (!b)
+		return false;
+	struct bt_leaf *leaf = internal_bt_first(t->bt);
+	size_t pos = 0;
+	struct map_pair *old = internal_bt_next(&leaf, &pos);
+	while (old || i < n)
+	{
+		int x = !old   ? -1 :
+		        i == n ?  1 :
+		        t->cmp(pairs[i].k, old->k, t->cmp_aux);
+		struct map_pair p;
+		if (x < 0)
+			p = pairs[i++];
+		else
+		{
+			p = *old;
+			if (x == 0)
+			{
+				internal_tm_replace(t, &p, pairs[i].k, pairs[i].v);
+				i++;
+			}
+			old = internal_bt_next(&leaf, &pos);
+		}
+		internal_bt_build_add(b, p);
+	}
+	internal_bt_build_end(b);
+	return true;
+}
+
+bool
+tm_insert_sorted(treemap *t, const struct map_pair *pairs, size_t n)
+{
+	if (!t || t->snapshot || (n > 0 && !pairs))
+		return false;
+	if (t->bt)
+		return internal_tm_bt_insert_sorted(t, pairs, n);
+	internal_tm_begin(t);
+	size_t had = t->root->size;
+	if (n * internal_tm_log2(had + n) < had)
+	{
+		/* a few keys into a big tree, cheaper one by one, and
+		 * with what each insert might take reserved up front */
+		if (!internal_tm_reserve(t, n * internal_tm_write_cost(t, had + n)))
+			return false;
+		for (size_t i = 0; i < n; i++)
+			tm_insert(t, pairs[i].k, pairs[i].v);
+		return true;
+	}
+	/* flattening copies every node snapshots share, and each pair
+	 * replaced needs retiring */
+	if (!internal_tm_reserve(t, n + (t->cow ? had + n : 0)))
+		return false;
+
+	struct tm_node *old = internal_tm_flatten(t), *list, **link = &list;
+	size_t size = 0, i = 0;
+	while (old != t->bottom || i < n)
+	{
+		int x = old == t->bottom ? -1 :
+		        i == n           ?  1 :
+		        t->cmp(pairs[i].k, old->pair.k, t->cmp_aux);
+		struct tm_node *next;
+		if (x < 0)
+		{
+			next = internal_tm_node_alloc(t);
+			next->refs = 1;
+			next->pair = pairs[i++];
+		}
+		else
+		{
+			if (x == 0)
+			{
+				internal_tm_replace(t, &old->pair, pairs[i].k, pairs[i].v);
+				i++;
+			}
+			next = old;
+			old = old->right;
+		}
+		*link = next;
+		link = &next->right;
+		size++;
+	}
+	*link = t->bottom;
+	t->root = internal_tm_build(t, &list, size);
+	internal_tm_find_ends(t);
+	return true;
+}
+
+treemap *
+tm_from_sorted(const struct map_pair *pairs, size_t n,
+               comparator *cmp, void *cmp_aux)
+{
+	treemap *t = tm_new(cmp, cmp_aux);
+	if (t && !tm_insert_sorted(t, pairs, n))
+	{
+		tm_free(t);
+		return NULL;
+	}
+	return t;
+}
+
+/* Set operations walk both maps in order at once. For an AA tree dst
+ * that's one pass over a flattened dst that keeps its nodes, and a
+ * rebuild at the end. A B+ tree dst is merged into fresh leaves. */
+
+enum tm_setop { TM_UNION, TM_INTERSECTION, TM_DIFFERENCE };
+
+static void
+internal_tm_merge_val(treemap *dst, void **slot, void *src_val,
+                      tm_merger *fn, void *aux)
+{
+	if (!fn)
+		return;
+	void *val = fn(*slot, src_val, aux);
+	if (*slot != val)
+		internal_tm_discard(dst, (struct map_pair){.v = *slot}, TM_DROP_VAL);
+	*slot = val;
+}
+
+static void
+internal_tm_destroy_pair(treemap *t, struct map_pair *p)
+{
+	internal_tm_discard(t, *p, TM_DROP_KEY | TM_DROP_VAL);
+}
+
+static bool
+internal_tm_bt_setop(treemap *dst, treemap *src, enum tm_setop op,
+                     tm_merger *fn, void *aux)
+{
+	size_t had = internal_bt_length(dst->bt);
+	struct bt_build *b = internal_bt_build_begin(dst->bt,
+		had + (op == TM_UNION ? tm_length(src) : 0));
+	if (!b)
+		return false;
+
+	tm_iter i;
+	tm_iter_init(&i, src);
+	struct map_pair *p = tm_iter_next(&i);
+	struct bt_leaf *leaf = internal_bt_first(dst->bt);
+	size_t pos = 0;
+	struct map_pair *old = internal_bt_next(&leaf, &pos);
+	while (old || (p && op == TM_UNION))
 	{
-		t->deleted = n;
-		n->right = internal_tm_remove(t, n->right, key);
+		int x = !old ?  1 :
+		        !p   ? -1 :
+		        dst->cmp(old->k, p->k, dst->cmp_aux);
+		if (x > 0)
+		{
+			/* only in src */
+			if (op == TM_UNION)
+				internal_bt_build_add(b, *p);
+			p = tm_iter_next(&i);
+			continue;
+		}
+		struct map_pair keep = *old;
+		bool in_src = x == 0;
+		old = internal_bt_next(&leaf, &pos);
+		if (in_src && op != TM_DIFFERENCE)
+			internal_tm_merge_val(dst, &keep.v, p->v, fn, aux);
+		if (op == TM_UNION ||
+		    (op == TM_INTERSECTION ? in_src : !in_src))
+			internal_bt_build_add(b, keep);
+		else
+			internal_tm_destroy_pair(dst, &keep);
+		if (in_src)
+			p = tm_iter_next(&i);
 	}
+	internal_bt_build_end(b);
+	return true;
+}
 
-	/* 2: At the bottom of the tree, remove element if present */
+static bool
+internal_tm_setop(treemap *dst, const treemap *src, enum tm_setop op,
+                  tm_merger *fn, void *aux)
+{
+	if (!dst || !src || dst == src || dst->snapshot)
+		return false;
+	if (dst->bt)
+		return internal_tm_bt_setop(dst, (treemap *)src, op, fn, aux);
 
-	if (n == t->last && t->deleted != t->bottom &&
-	    t->cmp(key, t->deleted->pair->k, t->cmp_aux) == 0)
+	internal_tm_begin(dst);
+	/* with snapshots, a copy of each node and a node to retire what
+	 * it drops */
+	size_t had = dst->root->size,
+	       need = (op == TM_UNION ? tm_length(src) : 0) +
+	              (dst->cow ? 2*had : 0);
+	if (!internal_tm_reserve(dst, need))
+		return false;
+
+	tm_iter i;
+	tm_iter_init(&i, (treemap *)src);
+	struct map_pair *p = tm_iter_next(&i);
+	struct tm_node *old = internal_tm_flatten(dst), *list, **link = &list;
+	size_t size = 0;
+	while (old != dst->bottom || (p && op == TM_UNION))
 	{
-		if (t->key_dtor)
-			t->key_dtor(t->deleted->pair->k, t->dtor_aux);
-		if (t->val_dtor)
-			t->val_dtor(t->deleted->pair->v, t->dtor_aux);
+		int x = old == dst->bottom ?  1 :
+		        !p                 ? -1 :
+		        dst->cmp(old->pair.k, p->k, dst->cmp_aux);
+		struct tm_node *keep = NULL;
+		if (x > 0)
+		{
+			/* only in src */
+			if (op == TM_UNION)
+			{
+				keep = internal_tm_node_alloc(dst);
+				keep->refs = 1;
+				keep->pair = *p;
+			}
+			p = tm_iter_next(&i);
+		}
+		else
+		{
+			struct tm_node *n = old;
+			bool in_src = x == 0;
+			old = old->right;
+			if (in_src && op != TM_DIFFERENCE)
+				internal_tm_merge_val(dst, &n->pair.v, p->v, fn, aux);
+			if (op == TM_UNION ||
+			    (op == TM_INTERSECTION ? in_src : !in_src))
+				keep = n;
+			else
+			{
+				internal_tm_destroy_pair(dst, &n->pair);
+				internal_tm_node_free(dst->pool, n);
+			}
+			if (in_src)
+				p = tm_iter_next(&i);
+		}
+		if (keep)
+		{
+			*link = keep;
+			link = &keep->right;
+			size++;
+		}
+	}
+	*link = dst->bottom;
+	dst->root = internal_tm_build(dst, &list, size);
+	internal_tm_find_ends(dst);
+	return true;
+}
 
-		*t->deleted->pair = *n->pair;
-		t->deleted = t->bottom;
-		n = n->right;
+bool
+tm_union(treemap *dst, const treemap *src, tm_merger *fn, void *aux)
+{
+	return internal_tm_setop(dst, src, TM_UNION, fn, aux);
+}
 
-		internal_free(t->last->pair);
-		internal_free(t->last);
-	} /* 3: on the way back up, rebalance */
-	else if (n->left->level  < n->level-1 ||
-	         n->right->level < n->level-1) {
-		n->level--;
-		if (n->right->level > n->level)
-			n->right->level = n->level;
-		n               = internal_tm_skew(n);
-		n->right        = internal_tm_skew(n->right);
-		n->right->right = internal_tm_skew(n->right->right);
-		n               = internal_tm_split(n);
-		n->right        = internal_tm_split(n->right);
+bool
+tm_intersection(treemap *dst, const treemap *src, tm_merger *fn, void *aux)
+{
+	return internal_tm_setop(dst, src, TM_INTERSECTION, fn, aux);
+}
+
+bool
+tm_difference(treemap *dst, const treemap *src)
+{
+	return internal_tm_setop(dst, src, TM_DIFFERENCE, NULL, NULL);
+}
+
+/* on the way back up from a removal, restore the levels */
+static struct tm_node *
+internal_tm_remove_fix(treemap *t, struct tm_node *n)
+{
+	if (n->left->level  >= n->level-1 &&
+	    n->right->level >= n->level-1)
+		return n;
+	n->level--;
+	if (n->right->level > n->level)
+		internal_tm_own(t, &n->right)->level = n->level;
+	/* skew and split leave the sentinel alone,
+	 * but don't even store it back */
+	n = internal_tm_skew(t, n);
+	if (n->right->level)
+	{
+		n->right = internal_tm_skew(t, internal_tm_own(t, &n->right));
+		if (n->right->right->level)
+			n->right->right = internal_tm_skew(t,
+				internal_tm_own(t, &n->right->right));
 	}
+	n = internal_tm_split(t, n);
+	if (n->right->level)
+		n->right = internal_tm_split(t, internal_tm_own(t, &n->right));
 	return n;
 }
 
+/* Andersson's removal: walk to the bottom remembering the last node
+ * where we turned right, which holds key if anything does. Its pair
+ * trades places with the last node on the path, its successor, which
+ * is the one that actually leaves the tree. */
+static bool
+internal_tm_remove(treemap *t, const void *key, struct map_pair *removed)
+{
+	/* don't copy a path for nothing */
+	if (internal_tm_begin(t) && !internal_tm_find(t, key))
+		return false;
+	if (!internal_tm_prepare(t))
+		return false;
+	struct tm_path path = {.depth = 0};
+	struct tm_node **link = &t->root, *n, *deleted = NULL;
+	bool found = false;
+	while ((n = internal_tm_own(t, link)) != t->bottom)
+	{
+		int x = t->cmp(key, n->pair.k, t->cmp_aux);
+		internal_tm_push(&path, n, x < 0);
+		if (x < 0)
+			link = &n->left;
+		else
+		{
+			deleted = n;
+			found = x == 0;
+			link = &n->right;
+		}
+	}
+	if (!found)
+		return false;
+	struct tm_node *last = path.nodes[--path.depth];
+	bool ends = t->cow || deleted == t->min || deleted == t->max ||
+	            last == t->min || last == t->max;
+	*removed = deleted->pair;
+	deleted->pair = last->pair;
+	n = last->right;
+	internal_tm_node_free(t->pool, last);
+	internal_tm_unwind(t, &path, n, internal_tm_remove_fix);
+	if (ends)
+		internal_tm_find_ends(t);
+	return true;
+}
+
 bool
 tm_remove(treemap *t, void *key)
 {
-	if (!t)
+	if (!t || t->snapshot)
 		return false;
-	t->root = internal_tm_remove(t, t->root, key);
-	return true; // TODO: return false if key wasn't found
+	struct map_pair gone;
+	if (t->bt ? !internal_bt_remove(t->bt, key, &gone)
+	          : !internal_tm_remove(t, key, &gone))
+		return false;
+	internal_tm_destroy_pair(t, &gone);
+	return true;
+}
+
+struct map_pair *
+tm_lower_bound(const treemap *t, const void *key)
+{
+	if (!t)
+		return NULL;
+	if (t->bt)
+	{
+		struct bt_leaf *leaf;
+		size_t pos;
+		internal_bt_seek(t->bt, key, false, &leaf, &pos);
+		return internal_bt_next(&leaf, &pos);
+	}
+	struct tm_node *n = t->root, *best = NULL;
+	while (n != t->bottom)
+	{
+		int x = t->cmp(key, n->pair.k, t->cmp_aux);
+		if (x > 0)
+			n = n->right;
+		else
+		{
+			best = n;
+			if (x == 0)
+				break;
+			n = n->left;
+		}
+	}
+	return best ? &best->pair : NULL;
+}
+
+struct map_pair *
+tm_upper_bound(const treemap *t, const void *key)
+{
+	if (!t)
+		return NULL;
+	if (t->bt)
+	{
+		struct bt_leaf *leaf;
+		size_t pos;
+		internal_bt_seek(t->bt, key, true, &leaf, &pos);
+		return internal_bt_next(&leaf, &pos);
+	}
+	struct tm_node *n = t->root, *best = NULL;
+	while (n != t->bottom)
+	{
+		if (t->cmp(key, n->pair.k, t->cmp_aux) < 0)
+		{
+			best = n;
+			n = n->left;
+		}
+		else
+			n = n->right;
+	}
+	return best ? &best->pair : NULL;
+}
+
+struct map_pair *
+tm_floor(const treemap *t, const void *key)
+{
+	if (!t)
+		return NULL;
+	if (t->bt)
+	{
+		struct bt_leaf *leaf;
+		size_t pos;
+		internal_bt_seek(t->bt, key, true, &leaf, &pos);
+		return internal_bt_prev(&leaf, &pos);
+	}
+	struct tm_node *n = t->root, *best = NULL;
+	while (n != t->bottom)
+	{
+		int x = t->cmp(key, n->pair.k, t->cmp_aux);
+		if (x < 0)
+			n = n->left;
+		else
+		{
+			best = n;
+			if (x == 0)
+				break;
+			n = n->right;
+		}
+	}
+	return best ? &best->pair : NULL;
 }
 
+struct map_pair *
+tm_ceiling(const treemap *t, const void *key)
+{
+	return tm_lower_bound(t, key);
+}
+
+size_t
+tm_rank(const treemap *t, const void *key)
+{
+	if (!t)
+		return 0;
+	if (t->bt)
+		return internal_bt_rank(t->bt, key);
+	size_t rank = 0;
+	const struct tm_node *n = t->root;
+	while (n != t->bottom)
+	{
+		int x = t->cmp(key, n->pair.k, t->cmp_aux);
+		if (x == 0)
+			return rank + n->left->size;
+		if (x < 0)
+			n = n->left;
+		else
+		{
+			rank += n->left->size + 1;
+			n = n->right;
+		}
+	}
+	return rank;
+}
+
+struct map_pair *
+tm_select(const treemap *t, size_t i)
+{
+	if (!t)
+		return NULL;
+	if (t->bt)
+		return internal_bt_select(t->bt, i);
+	struct tm_node *n = t->root;
+	while (n != t->bottom)
+	{
+		if (i < n->left->size)
+			n = n->left;
+		else if (i == n->left->size)
+			return &n->pair;
+		else
+		{
+			i -= n->left->size + 1;
+			n = n->right;
+		}
+	}
+	return NULL;
+}
+
+struct map_pair *
+tm_first(const treemap *t)
+{
+	if (!t)
+		return NULL;
+	if (t->bt)
+	{
+		struct bt_leaf *leaf = internal_bt_first(t->bt);
+		size_t pos = 0;
+		return internal_bt_next(&leaf, &pos);
+	}
+	return t->min == t->bottom ? NULL : &t->min->pair;
+}
+
+struct map_pair *
+tm_last(const treemap *t)
+{
+	if (!t)
+		return NULL;
+	if (t->bt)
+	{
+		struct bt_leaf *leaf;
+		size_t pos;
+		internal_bt_last(t->bt, &leaf, &pos);
+		return internal_bt_prev(&leaf, &pos);
+	}
+	return t->max == t->bottom ? NULL : &t->max->pair;
+}
+
+/* With no snapshots, every node in use is either in the tree or free,
+ * and free nodes have level 0 */
 static void
-internal_tm_clear(treemap *t, struct tm_node *n)
+internal_tm_clear(treemap *t)
 {
-	if (n == t->bottom)
-		return;
-	internal_tm_clear(t, n->left);
-	internal_tm_clear(t, n->right);
-	if (t->key_dtor)
-		t->key_dtor(n->pair->k, t->dtor_aux);
-	if (t->val_dtor)
-		t->val_dtor(n->pair->v, t->dtor_aux);
-	internal_free(n->pair);
-	internal_free(n);
+	struct tm_pool *pool = t->pool;
+	struct tm_slab *s, *next;
+	for (s = pool->slabs; s; s = next)
+	{
+		next = s->next;
+		if (t->key_dtor || t->val_dtor)
+			for (size_t i = 0; i < s->used; i++)
+			{
+				struct tm_node *n = &s->nodes[i];
+				if (n->level == 0)
+					continue;
+				if (t->key_dtor)
+					t->key_dtor(n->pair.k, t->dtor_aux);
+				if (t->val_dtor)
+					t->val_dtor(n->pair.v, t->dtor_aux);
+			}
+		internal_free(s);
+	}
+	pool->slabs = NULL;
+	pool->free_nodes = pool->returned = NULL;
+	pool->nfree = 0;
 }
 
 void
 tm_clear(treemap *t)
 {
-	if (!t)
+	if (!t || t->snapshot)
 		return;
-	internal_tm_clear(t, t->root);
-	t->root = t->deleted = t->last = t->bottom;
+	if (t->bt)
+		internal_bt_clear(t->bt, t->key_dtor, t->val_dtor, t->dtor_aux);
+	if (!internal_tm_begin(t))
+		internal_tm_clear(t);
+	else if (t->key_dtor || t->val_dtor)
+	{
+		/* retire the whole tree */
+		if (!internal_tm_reserve(t, 1))
+			return;
+		struct tm_node *r = internal_tm_node_alloc(t);
+		*r = (struct tm_node){
+			.size = TM_DROP_TREE, .right = t->root,
+			.left = t->pool->retired
+		};
+		t->pool->retired = r;
+	}
+	else
+		internal_tm_release(t->pool, t->root);
+	t->root = t->min = t->max = t->bottom;
+}
+
+void
+tm_iter_init(tm_iter *i, treemap *t)
+{
+	if (!i)
+		return;
+	i->depth = 0;
+	i->after = false;
+	i->leaf = NULL;
+	i->pos = 0;
+	i->t = t;
+	i->start = i->end = NULL;
+	if (t && t->bt)
+		i->leaf = internal_bt_first(t->bt);
+}
+
+void
+tm_iter_init_end(tm_iter *i, treemap *t)
+{
+	tm_iter_init(i, t);
+	if (!i || !t)
+		return;
+	i->after = true;
+	if (t->bt)
+		internal_bt_last(t->bt, &i->leaf, &i->pos);
+}
+
+void
+tm_iter_range(tm_iter *i, treemap *t, const void *from, const void *to)
+{
+	tm_iter_init(i, t);
+	if (!i || !t)
+		return;
+	i->start = from;
+	i->end = to;
+	if (!from)
+		return;
+	if (t->bt)
+	{
+		internal_bt_seek(t->bt, from, false, &i->leaf, &i->pos);
+		return;
+	}
+	/* put the cursor before the first node >= from, keeping the
+	 * path down to it */
+	size_t found = 0;
+	for (struct tm_node *n = t->root; n != t->bottom; )
+	{
+		int x = t->cmp(from, n->pair.k, t->cmp_aux);
+		assert(i->depth < TM_ITER_MAX_DEPTH);
+		i->stack[i->depth++] = n;
+		if (x > 0)
+			n = n->right;
+		else
+		{
+			found = i->depth;
+			if (x == 0)
+				break;
+			n = n->left;
+		}
+	}
+	i->depth = found;
+	i->after = found == 0; /* nothing that big */
 }
 
 tm_iter *
@@ -283,45 +1466,106 @@ tm_iter_begin(treemap *t)
 {
 	if (!t)
 		return NULL;
-	struct tm_iter *i = internal_malloc(sizeof *i);
-	list *l = l_new();
-	if (!i || !l)
+	tm_iter *i = internal_malloc(sizeof *i);
+	tm_iter_init(i, t);
+	return i;
+}
+
+/* Move the cursor over one node, forward or back, and return it */
+static struct tm_node *
+internal_tm_iter_step(tm_iter *i, bool fwd)
+{
+	struct tm_node *bottom = i->t->bottom, *n, *top;
+	if (i->depth == 0)
 	{
-		internal_free(i);
-		l_free(l);
-		return NULL;
+		/* at an end, either the one we're heading to,
+		 * or the one to enter the tree from */
+		if (i->after == fwd)
+			return NULL;
+		n = i->t->root;
 	}
-	*i = (struct tm_iter){
-		.stack = l,
-		.n = t->root,
-		.bottom = t->bottom
-	};
-	return i;
+	else
+	{
+		top = i->stack[i->depth-1];
+		if (i->after != fwd)
+		{
+			/* just hop over the node beside the cursor */
+			i->after = fwd;
+			return top;
+		}
+		n = fwd ? top->right : top->left;
+		if (n == bottom)
+		{
+			/* climb out of the subtrees that are done */
+			struct tm_node *child;
+			do
+				child = i->stack[--i->depth];
+			while (i->depth > 0 &&
+			       (fwd ? i->stack[i->depth-1]->right
+			            : i->stack[i->depth-1]->left) == child);
+			i->after = fwd;
+			return i->depth > 0 ? i->stack[i->depth-1] : NULL;
+		}
+	}
+	/* down to the nearest node of subtree n */
+	for (; n != bottom; n = fwd ? n->left : n->right)
+	{
+		assert(i->depth < TM_ITER_MAX_DEPTH);
+		i->stack[i->depth++] = n;
+	}
+	if (i->depth == 0)
+		return NULL; /* empty tree */
+	i->after = fwd;
+	return i->stack[i->depth-1];
 }
 
-struct map_pair *
-tm_iter_next(tm_iter *i)
+static struct map_pair *
+internal_tm_iter_move(tm_iter *i, bool fwd)
 {
-	if (!i)
+	if (!i || !i->t)
 		return NULL;
-	if (l_is_empty(i->stack) && i->n == i->bottom)
-		return NULL; /* done */
-	if (i->n != i->bottom)
+	struct map_pair *p;
+	if (i->t->bt)
+		p = fwd ? internal_bt_next(&i->leaf, &i->pos)
+		        : internal_bt_prev(&i->leaf, &i->pos);
+	else
+	{
+		struct tm_node *n = internal_tm_iter_step(i, fwd);
+		p = n ? &n->pair : NULL;
+	}
+	const void *bound = fwd ? i->end : i->start;
+	if (p && bound)
 	{
-		if (!l_append(i->stack, i->n))
-			return NULL; /* OOM */
-		i->n = i->n->left;
-		return tm_iter_next(i);
+		int x = i->t->cmp(p->k, bound, i->t->cmp_aux);
+		if (fwd ? x >= 0 : x < 0)
+		{
+			/* outside the range, so step back in */
+			if (!i->t->bt)
+				internal_tm_iter_step(i, !fwd);
+			else if (fwd)
+				internal_bt_prev(&i->leaf, &i->pos);
+			else
+				internal_bt_next(&i->leaf, &i->pos);
+			return NULL;
+		}
 	}
-	struct tm_node *result = l_remove_last(i->stack);
-	i->n = result->right;
-	return result->pair;
+	return p;
+}
+
+struct map_pair *
+tm_iter_next(tm_iter *i)
+{
+	return internal_tm_iter_move(i, true);
+}
+
+struct map_pair *
+tm_iter_prev(tm_iter *i)
+{
+	return internal_tm_iter_move(i, false);
 }
 
 void
 tm_iter_free(tm_iter *i)
 {
-	if (i)
-		l_free(i->stack);
 	internal_free(i);
 }
@@ -0,0 +1,205 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal/alloc.h"
+#include "internal/vector.h"
+#include "derp/vector.h"
+
+/* Parallel sort: each thread sorts a run of the vector, then rounds of
+ * merges pair the runs up until one is left. The merges ping-pong
+ * between the vector's array and a scratch array, and within a round
+ * the output is cut into equal shares, one per thread, with each
+ * share's starting point in the two input runs found by binary search
+ * (the "merge path"). Shares stay equal however the keys fall, even
+ * with heavy duplication. */
+
+#define PARALLEL_MIN_RUN (1 << 14)
+
+struct v_par
+{
+	vector *v;
+	comparator *cmp;
+	void *aux;
+	size_t nthreads;
+	char *src, *dst;
+	/* runs are [bounds[i], bounds[i+1]) */
+	size_t *bounds, nruns;
+};
+
+struct v_par_task
+{
+	struct v_par *p;
+	size_t id;
+	void (*fn)(struct v_par *, size_t id);
+	pthread_t thread;
+	bool started;
+};
+
+static void *
+internal_v_par_elt(const struct v_par *p, const char *buf, size_t i)
+{
+	const char *slot = buf + i * p->v->elt_size;
+	if (p->v->by_value)
+		return (void *)slot;
+	return *(void **)slot;
+}
+
+static void
+internal_v_par_sort(struct v_par *p, size_t id)
+{
+	struct v_sort s = {.v = p->v, .elts = p->src, .by_value = p->v->by_value,
+	                   .cmp = p->cmp, .aux = p->aux};
+	internal_v_sort_range(&s, p->bounds[id], p->bounds[id+1] - p->bounds[id]);
+}
+
+/* how many of the first k in the merge of a (length na) and b (length
+ * nb) come from a, when ties go to a */
+static size_t
+internal_v_par_corank(const struct v_par *p, size_t a, size_t na,
+                      size_t b, size_t nb, size_t k)
+{
+	size_t lo = k > nb ? k - nb : 0, hi = k < na ? k : na;
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo + 1)/2, j = k - mid;
+		if (j >= nb ||
+		    p->cmp(internal_v_par_elt(p, p->src, a + mid-1),
+		           internal_v_par_elt(p, p->src, b + j), p->aux) <= 0)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+/* merge the share of this round's output that's thread id's */
+static void
+internal_v_par_merge(struct v_par *p, size_t id)
+{
+	size_t n = p->v->length, t = p->nthreads, size = p->v->elt_size,
+	       out_lo = n/t * id + n%t * id / t,
+	       out_hi = n/t * (id+1) + n%t * (id+1) / t;
+
+	for (size_t r = 0; r < p->nruns && p->bounds[r] < out_hi; r += 2)
+	{
+		size_t a = p->bounds[r], b = p->bounds[r+1],
+		       end = r+1 < p->nruns ? p->bounds[r+2] : b,
+		       lo = a > out_lo ? a : out_lo,
+		       hi = end < out_hi ? end : out_hi;
+		if (lo >= hi)
+			continue;
+		if (b == end)
+		{
+			/* the odd run out */
+			memcpy(p->dst + lo*size, p->src + lo*size, (hi - lo) * size);
+			continue;
+		}
+		size_t i = a + internal_v_par_corank(p, a, b-a, b, end-b, lo-a),
+		       j = b + (lo - a) - (i - a),
+		       i_end = a + internal_v_par_corank(p, a, b-a, b, end-b, hi-a),
+		       j_end = b + (hi - a) - (i_end - a);
+		for (size_t k = lo; k < hi; k++)
+		{
+			size_t from;
+			if (j >= j_end ||
+			    (i < i_end &&
+			     p->cmp(internal_v_par_elt(p, p->src, i),
+			            internal_v_par_elt(p, p->src, j), p->aux) <= 0))
+				from = i++;
+			else
+				from = j++;
+			memcpy(p->dst + k*size, p->src + from*size, size);
+		}
+	}
+}
+
+static void *
+internal_v_par_run(void *arg)
+{
+	struct v_par_task *task = arg;
+	task->fn(task->p, task->id);
+	return NULL;
+}
+
+/* run fn for every id on its own thread, or this one if a thread can't
+ * be had */
+static void
+internal_v_par_phase(struct v_par *p, struct v_par_task *tasks,
+                     void (*fn)(struct v_par *, size_t))
+{
+	for (size_t id = 0; id < p->nthreads; id++)
+	{
+		struct v_par_task *task = tasks + id;
+		*task = (struct v_par_task){.p = p, .id = id, .fn = fn};
+		task->started = id > 0 &&
+			pthread_create(&task->thread, NULL, internal_v_par_run, task) == 0;
+	}
+	for (size_t id = 0; id < p->nthreads; id++)
+		if (!tasks[id].started)
+			fn(p, id);
+	for (size_t id = 0; id < p->nthreads; id++)
+		if (tasks[id].started)
+			pthread_join(tasks[id].thread, NULL);
+}
+
+bool
+v_sort_parallel(vector *v, comparator *cmp, void *aux, unsigned nthreads)
+{
+	if (!v || !cmp)
+		return false;
+#ifdef _SC_NPROCESSORS_ONLN
+	if (nthreads == 0)
+	{
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = online > 0 ? (unsigned)online : 1;
+	}
+#endif
+	size_t n = v->length, t = nthreads;
+	if (t > n / PARALLEL_MIN_RUN)
+		t = n / PARALLEL_MIN_RUN;
+	if (t < 2)
+		return v_sort(v, cmp, aux);
+
+	size_t size = v->elt_size;
+	char *scratch = internal_malloc(v->capacity * size);
+	size_t *bounds = internal_malloc((t+1) * sizeof *bounds);
+	struct v_par_task *tasks = internal_malloc(t * sizeof *tasks);
+	if (!scratch || !bounds || !tasks)
+	{
+		internal_free(scratch);
+		internal_free(bounds);
+		internal_free(tasks);
+		return v_sort(v, cmp, aux);
+	}
+
+	internal_v_unwrap(v);
+	struct v_par p = {
+		.v = v, .cmp = cmp, .aux = aux, .nthreads = t,
+		.src = v->elts, .dst = scratch, .bounds = bounds, .nruns = t
+	};
+	for (size_t i = 0; i <= t; i++)
+		bounds[i] = n/t * i + n%t * i / t;
+	internal_v_par_phase(&p, tasks, internal_v_par_sort);
+
+	while (p.nruns > 1)
+	{
+		internal_v_par_phase(&p, tasks, internal_v_par_merge);
+		for (size_t i = 0; 2*i < p.nruns; i++)
+			bounds[i] = bounds[2*i];
+		p.nruns = (p.nruns + 1) / 2;
+		bounds[p.nruns] = n;
+		char *swap = p.src;
+		p.src = p.dst;
+		p.dst = swap;
+	}
+
+	/* keep whichever array the result landed in */
+	v->elts = p.src;
+	internal_free(p.dst);
+	internal_free(bounds);
+	internal_free(tasks);
+	return true;
+}
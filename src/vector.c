@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "internal/alloc.h"
+#include "internal/vector.h"
 #include "derp/vector.h"
 #include "derp/common.h"
 
@@ -16,15 +17,6 @@
 
 #define SWAP(x, y) do { void *swaptmp = (x); (x) = (y); (y) = swaptmp; } while (0)
 
-struct vector
-{
-	size_t length;
-	size_t capacity;
-	void **elts;
-	dtor *elt_dtor;
-	void *dtor_aux;
-};
-
 static void
 internal_check(const vector *v)
 {
@@ -36,27 +28,173 @@ internal_check(const vector *v)
 	if (v->capacity < SIZE_MAX)
 		assert((v->capacity & (v->capacity - 1)) == 0);
 	assert(v->length <= v->capacity);
+	assert(v->head < v->capacity);
+	assert(v->elt_size > 0);
+	assert(v->by_value || v->elt_size == sizeof(void *));
 }
 
-vector *
-v_new(void)
+static vector *
+internal_v_new(size_t elt_size, bool by_value)
 {
+	if (elt_size == 0 || elt_size > SIZE_MAX / INITIAL_CAPACITY)
+		return NULL;
 	vector *v   = internal_malloc(sizeof *v);
-	void **elts = internal_malloc(INITIAL_CAPACITY * sizeof *elts);
-	if (!v || !elts)
+	char *elts  = internal_malloc(INITIAL_CAPACITY * elt_size);
+	void *removed = by_value ? internal_malloc(elt_size) : NULL;
+	if (!v || !elts || (by_value && !removed))
 	{
 		internal_free(v);
 		internal_free(elts);
+		internal_free(removed);
 		return NULL;
 	}
 	*v = (vector){
 		.capacity = INITIAL_CAPACITY,
-		.elts = elts
+		.elt_size = elt_size,
+		.by_value = by_value,
+		.elts = elts,
+		.removed = removed
 	};
 	CHECK(v);
 	return v;
 }
 
+vector *
+v_new(void)
+{
+	return internal_v_new(sizeof(void *), false);
+}
+
+vector *
+v_new_sized(size_t elt_size)
+{
+	return internal_v_new(elt_size, true);
+}
+
+/* The elements form a ring in the array, starting at slot head and
+ * wrapping around past the end, so both ends grow and shrink without
+ * moving the rest. */
+
+/* array slot of element i, for i up to the capacity */
+static size_t
+internal_v_pos(const vector *v, size_t i)
+{
+	return i < v->capacity - v->head ? v->head + i
+	                                 : i - (v->capacity - v->head);
+}
+
+static void *
+internal_v_slot(const vector *v, size_t i)
+{
+	return v->elts + internal_v_pos(v, i) * v->elt_size;
+}
+
+/* what callers see as element i */
+static void *
+internal_v_elt(const vector *v, size_t i)
+{
+	if (v->by_value)
+		return internal_v_slot(v, i);
+	return ((void **)v->elts)[internal_v_pos(v, i)];
+}
+
+static void
+internal_v_store(vector *v, size_t i, void *elt)
+{
+	if (!v->by_value)
+		((void **)v->elts)[internal_v_pos(v, i)] = elt;
+	else if (elt)
+		memcpy(internal_v_slot(v, i), elt, v->elt_size);
+	else
+		memset(internal_v_slot(v, i), 0, v->elt_size);
+}
+
+static void
+internal_v_swap_bytes(unsigned char *a, unsigned char *b, size_t size)
+{
+	unsigned char tmp[64];
+	for (size_t k = 0; k < size; k += sizeof tmp)
+	{
+		size_t n = size - k < sizeof tmp ? size - k : sizeof tmp;
+		memcpy(tmp, a+k, n);
+		memcpy(a+k, b+k, n);
+		memcpy(b+k, tmp, n);
+	}
+}
+
+static void
+internal_v_swap(vector *v, size_t i, size_t j)
+{
+	if (!v->by_value)
+	{
+		void **elts = (void **)v->elts;
+		SWAP(elts[internal_v_pos(v, i)], elts[internal_v_pos(v, j)]);
+		return;
+	}
+	internal_v_swap_bytes(internal_v_slot(v, i), internal_v_slot(v, j),
+	                      v->elt_size);
+}
+
+/* move the n elements at src to dst, like memmove, a piece at a time
+ * so that no piece wraps around in either place */
+static void
+internal_v_move(vector *v, size_t dst, size_t src, size_t n)
+{
+	size_t size = v->elt_size;
+	while (n > 0)
+	{
+		/* from the low end when moving down, else from the high */
+		bool down = dst < src;
+		size_t s = internal_v_pos(v, down ? src : src + n-1),
+		       d = internal_v_pos(v, down ? dst : dst + n-1),
+		       run = n;
+		if (down)
+		{
+			if (run > v->capacity - s)
+				run = v->capacity - s;
+			if (run > v->capacity - d)
+				run = v->capacity - d;
+			src += run;
+			dst += run;
+		}
+		else
+		{
+			if (run > s+1)
+				run = s+1;
+			if (run > d+1)
+				run = d+1;
+			s -= run-1;
+			d -= run-1;
+		}
+		memmove(v->elts + d*size, v->elts + s*size, run*size);
+		n -= run;
+	}
+}
+
+/* Put element 0 at the start of the array, for code that wants the
+ * elements in one piece. A ring that wraps is rotated in place by
+ * three reversals of the whole array, so this costs O(capacity) then,
+ * and O(length) otherwise. */
+void
+internal_v_unwrap(vector *v)
+{
+	size_t cap = v->capacity, head = v->head, size = v->elt_size;
+	if (head == 0)
+		return;
+	if (v->length <= cap - head)
+		memmove(v->elts, v->elts + head*size, v->length * size);
+	else
+	{
+		size_t ranges[3][2] = {{0, head}, {head, cap}, {0, cap}};
+		for (int r = 0; r < 3; r++)
+			for (size_t i = ranges[r][0], j = ranges[r][1]; i+1 < j; i++, j--)
+				internal_v_swap_bytes((unsigned char *)v->elts + i*size,
+				                      (unsigned char *)v->elts + (j-1)*size,
+				                      size);
+	}
+	v->head = 0;
+}
+
 void
 v_dtor(vector *v, dtor *elt_dtor, void *dtor_aux)
 {
@@ -73,6 +211,7 @@ v_free(vector *v)
 		return;
 	v_clear(v);
 	internal_free(v->elts);
+	internal_free(v->removed);
 	internal_free(v);
 }
 
@@ -89,12 +228,14 @@ v_set_length(vector *v, size_t desired)
 		return false;
 	if (v->elt_dtor) /* free any, if necessary */
 		for (size_t i = desired; i < v->length; i++)
-			v->elt_dtor(v->elts[i], v->dtor_aux);
+			v->elt_dtor(internal_v_elt(v, i), v->dtor_aux);
 	if (v_reserve_capacity(v, desired) < desired)
 		return false;
 	for (size_t i = v->length; i < desired; i++)
-		v->elts[i] = NULL;
+		internal_v_store(v, i, NULL);
 	v->length = desired;
+	if (desired == 0)
+		v->head = 0;
 
 	CHECK(v);
 	return true;
@@ -120,12 +261,20 @@ v_reserve_capacity(vector *v, size_t desired)
 		n *= 2;
 	if (n == 0)
 		n = SIZE_MAX;
-	if (n > SIZE_MAX / (sizeof *v->elts))
+	if (n > SIZE_MAX / v->elt_size)
 		return v->capacity; /* realloc multiplication would overflow */
-	void **enlarged = internal_realloc(v->elts, n * sizeof *v->elts);
+	char *enlarged = internal_realloc(v->elts, n * v->elt_size);
 	if (!enlarged)
 		return v->capacity;
 	v->elts = enlarged;
+	/* a ring that wrapped gets its front part moved to the new end */
+	size_t front = v->capacity - v->head;
+	if (v->length > front)
+	{
+		memmove(v->elts + (n - front) * v->elt_size,
+		        v->elts + v->head * v->elt_size, front * v->elt_size);
+		v->head = n - front;
+	}
 	v->capacity = n;
 
 	CHECK(v);
@@ -143,7 +292,7 @@ v_at(const vector *v, size_t i)
 {
 	if (!v || i >= v->length)
 		return NULL;
-	return v->elts[i];
+	return internal_v_elt(v, i);
 }
 
 void *
@@ -188,8 +337,17 @@ v_remove(vector *v, size_t i)
 {
 	if (!v || i >= v->length)
 		return NULL;
-	void *elt = v->elts[i];
-	memmove(v->elts+i, v->elts+i+1, (v->length - (i+1)) * sizeof *v->elts);
+	void *elt = internal_v_elt(v, i);
+	if (v->by_value)
+		elt = memcpy(v->removed, elt, v->elt_size);
+	/* close the gap from whichever side is shorter */
+	if (i < v->length/2)
+	{
+		internal_v_move(v, 1, 0, i);
+		v->head = internal_v_pos(v, 1);
+	}
+	else
+		internal_v_move(v, i, i+1, v->length - (i+1));
 	v->length--;
 
 	CHECK(v);
@@ -201,8 +359,15 @@ v_insert(vector *v, size_t i, void *elt)
 {
 	if (!v || v_reserve_capacity(v, v->length+1) < v->length+1)
 		return false;
-	memmove(v->elts+i+1, v->elts+i, (v->length - i) * sizeof *v->elts);
-	v->elts[i] = elt;
+	/* open the gap from whichever side is shorter */
+	if (i < v->length/2)
+	{
+		v->head = internal_v_pos(v, v->capacity - 1);
+		internal_v_move(v, 0, 1, i);
+	}
+	else
+		internal_v_move(v, i+1, i, v->length - i);
+	internal_v_store(v, i, elt);
 	v->length++;
 
 	CHECK(v);
@@ -214,7 +379,7 @@ v_swap(vector *v, size_t i, size_t j)
 {
 	if (!v || i >= v->length || j >= v->length)
 		return false;
-	SWAP(v->elts[i], v->elts[j]);
+	internal_v_swap(v, i, j);
 
 	CHECK(v);
 	return true;
@@ -233,7 +398,7 @@ v_find_index(const vector *v, const void *needle,
 	if (!v || !cmp)
 		return SIZE_MAX;
 	for (size_t i = 0; i < v->length; i++)
-		if (cmp(v->elts[i], needle, aux) == 0)
+		if (cmp(internal_v_elt(v, i), needle, aux) == 0)
 			return i;
 	return SIZE_MAX;
 }
@@ -245,30 +410,243 @@ v_find_last_index(const vector *v, const void *needle,
 	if (!v || !cmp)
 		return SIZE_MAX;
 	for (size_t i = v->length-1; i < SIZE_MAX; i--)
-		if (cmp(v->elts[i], needle, aux) == 0)
+		if (cmp(internal_v_elt(v, i), needle, aux) == 0)
 			return i;
 	return SIZE_MAX;
 }
 
-/* from Bentley, https://www.youtube.com/watch?v=QvgYAQzg1z8 */
+/* Introsort: quicksort that falls back to heapsort when it recurses
+ * too deep, so it's O(n log n) whatever the input. Borrowing from
+ * Peters' pattern-defeating quicksort, a pivot equal to the element
+ * just before its range means a run of equal keys, which is split off
+ * in one pass. The larger side is looped on rather than recursed
+ * into, keeping the stack at O(log n), and small ranges get insertion
+ * sort. */
+
+#define INSERTION_MAX 16
+#define NINTHER_MIN 128
+#define BLOCK 64
+
+static inline void *
+internal_v_sort_elt(const struct v_sort *s, size_t i)
+{
+	if (s->by_value)
+		return s->elts + i * s->v->elt_size;
+	return ((void **)s->elts)[i];
+}
+
+static inline int
+internal_v_cmp(const struct v_sort *s, size_t i, size_t j)
+{
+	return s->cmp(internal_v_sort_elt(s, i), internal_v_sort_elt(s, j),
+	              s->aux);
+}
+
+static inline void
+internal_v_sort_swap(const struct v_sort *s, size_t i, size_t j)
+{
+	if (s->by_value)
+		internal_v_swap(s->v, i, j);
+	else
+		SWAP(((void **)s->elts)[i], ((void **)s->elts)[j]);
+}
+
+static void
+internal_v_insertion_sort(const struct v_sort *s, size_t lo, size_t n)
+{
+	for (size_t i = lo+1; i < lo+n; i++)
+		for (size_t j = i; j > lo && internal_v_cmp(s, j-1, j) > 0; j--)
+			internal_v_sort_swap(s, j-1, j);
+}
+
+static void
+internal_v_sift_down(const struct v_sort *s, size_t lo, size_t root,
+                     size_t n)
+{
+	size_t child;
+	while ((child = 2*root + 1) < n)
+	{
+		if (child+1 < n && internal_v_cmp(s, lo+child, lo+child+1) < 0)
+			child++;
+		if (internal_v_cmp(s, lo+root, lo+child) >= 0)
+			return;
+		internal_v_sort_swap(s, lo+root, lo+child);
+		root = child;
+	}
+}
+
+static void
+internal_v_heapsort(const struct v_sort *s, size_t lo, size_t n)
+{
+	for (size_t i = n/2; i-- > 0; )
+		internal_v_sift_down(s, lo, i, n);
+	for (size_t end = n-1; end > 0; end--)
+	{
+		internal_v_sort_swap(s, lo, lo+end);
+		internal_v_sift_down(s, lo, 0, end);
+	}
+}
+
+static size_t
+internal_v_median3(const struct v_sort *s, size_t a, size_t b, size_t c)
+{
+	if (internal_v_cmp(s, a, b) < 0)
+	{
+		if (internal_v_cmp(s, b, c) < 0)
+			return b;
+		return internal_v_cmp(s, a, c) < 0 ? c : a;
+	}
+	if (internal_v_cmp(s, a, c) < 0)
+		return a;
+	return internal_v_cmp(s, b, c) < 0 ? c : b;
+}
+
+/* median of three, or of three medians of three for big ranges */
+static size_t
+internal_v_pivot(const struct v_sort *s, size_t lo, size_t n)
+{
+	size_t mid = lo + n/2, hi = lo + n-1;
+	if (n < NINTHER_MIN)
+		return internal_v_median3(s, lo, mid, hi);
+	size_t d = n/8;
+	return internal_v_median3(s,
+		internal_v_median3(s, lo,       lo+d,  lo+2*d),
+		internal_v_median3(s, mid-d,    mid,   mid+d),
+		internal_v_median3(s, hi-2*d,   hi-d,  hi));
+}
+
+/* Partition around the pivot at lo into smaller elements and the
+ * rest, returning where the pivot lands. Blocks of comparisons are
+ * made up front and their results recorded as offsets, as in Edelkamp
+ * and Weiss, "BlockQuicksort", so there's no hard-to-predict branch
+ * on each one. What's left between the blocks is finished one by one. */
+static size_t
+internal_v_partition(const struct v_sort *s, size_t lo, size_t n)
+{
+	/* misplaced elements in the left and right blocks */
+	unsigned char offl[BLOCK], offr[BLOCK];
+	size_t first = lo+1, last = lo+n, nl = 0, nr = 0, sl = 0, sr = 0, k;
+
+	while (last - first >= 2*BLOCK)
+	{
+		if (nl == 0)
+			for (sl = 0, k = 0; k < BLOCK; k++)
+			{
+				offl[nl] = (unsigned char)k;
+				nl += internal_v_cmp(s, first+k, lo) >= 0;
+			}
+		if (nr == 0)
+			for (sr = 0, k = 0; k < BLOCK; k++)
+			{
+				offr[nr] = (unsigned char)k;
+				nr += internal_v_cmp(s, last-1-k, lo) < 0;
+			}
+		size_t swaps = nl < nr ? nl : nr;
+		for (k = 0; k < swaps; k++)
+			internal_v_sort_swap(s, first + offl[sl+k],
+			                     last-1 - offr[sr+k]);
+		nl -= swaps; sl += swaps;
+		nr -= swaps; sr += swaps;
+		if (nl == 0)
+			first += BLOCK;
+		if (nr == 0)
+			last -= BLOCK;
+	}
+	size_t m = first-1;
+	for (k = first; k < last; k++)
+		if (internal_v_cmp(s, k, lo) < 0)
+			internal_v_sort_swap(s, k, ++m);
+	internal_v_sort_swap(s, lo, m);
+	return m;
+}
+
+/* when the pivot at lo equals the element before the range, nothing
+ * in the range is smaller, so gather the ones equal to it at the
+ * front and return how many there are */
+static size_t
+internal_v_partition_equal(const struct v_sort *s, size_t lo, size_t n)
+{
+	size_t i = lo, j = lo + n;
+	for (;;)
+	{
+		while (internal_v_cmp(s, --j, lo) > 0)
+			;
+		while (++i < j && internal_v_cmp(s, i, lo) <= 0)
+			;
+		if (i >= j)
+			break;
+		internal_v_sort_swap(s, i, j);
+	}
+	return j + 1 - lo;
+}
+
 static void
-internal_quicksort(vector *v, size_t lo, size_t hi,
-                   comparator *cmp, void *aux)
+internal_v_introsort(const struct v_sort *s, size_t lo, size_t n,
+                     unsigned depth, bool leftmost)
 {
-	size_t i, m = lo;
-	if (lo >= hi)
+	while (n > INSERTION_MAX)
+	{
+		if (depth-- == 0)
+		{
+			internal_v_heapsort(s, lo, n);
+			return;
+		}
+		internal_v_sort_swap(s, lo, internal_v_pivot(s, lo, n));
+
+		/* unless the range starts the sort, everything before lo is
+		 * no greater than what's in it, so this spots a pivot from a
+		 * run of equal keys */
+		if (!leftmost && internal_v_cmp(s, lo-1, lo) >= 0)
+		{
+			size_t neq = internal_v_partition_equal(s, lo, n);
+			lo += neq;
+			n -= neq;
+			continue;
+		}
+		size_t p = internal_v_partition(s, lo, n),
+		       nless = p - lo, nmore = lo + n - p - 1;
+		if (nless < nmore)
+		{
+			internal_v_introsort(s, lo, nless, depth, leftmost);
+			lo = p + 1;
+			n = nmore;
+			leftmost = false;
+		}
+		else
+		{
+			internal_v_introsort(s, p + 1, nmore, depth, false);
+			n = nless;
+		}
+	}
+	internal_v_insertion_sort(s, lo, n);
+}
+
+void
+internal_v_sort_range(const struct v_sort *s, size_t lo, size_t n)
+{
+	size_t i;
+
+	/* input that's already in order, or backward, costs one pass */
+	for (i = 1; i < n && internal_v_cmp(s, lo+i-1, lo+i) <= 0; i++)
+		;
+	if (i >= n)
 		return;
-	for (i = lo+1; i <= hi; i++)
-		if (cmp(v->elts[i], v->elts[lo], aux) < 0)
+	if (i == 1)
+	{
+		for (i = 1; i < n && internal_v_cmp(s, lo+i-1, lo+i) >= 0; i++)
+			;
+		if (i >= n)
 		{
-			m++;
-			SWAP(v->elts[i], v->elts[m]);
+			for (i = 0; i < n/2; i++)
+				internal_v_sort_swap(s, lo+i, lo+n-1-i);
+			return;
 		}
-	SWAP(v->elts[lo], v->elts[m]);
+	}
 
-	if (m > 0) /* avoid wrapping size_t */
-		internal_quicksort(v, lo, m-1, cmp, aux);
-	internal_quicksort(v, m+1, hi, cmp, aux);
+	unsigned depth = 0;
+	for (i = n; i > 1; i >>= 1)
+		depth += 2;
+	internal_v_introsort(s, lo, n, depth, true);
 }
 
 bool
@@ -276,12 +654,108 @@ v_sort(vector *v, comparator *cmp, void *aux)
 {
 	if (!v || !cmp)
 		return false;
-	internal_quicksort(v, 0, v->length-1, cmp, aux);
+	internal_v_unwrap(v);
+	struct v_sort s = {.v = v, .elts = v->elts, .by_value = v->by_value,
+	                   .cmp = cmp, .aux = aux};
+	internal_v_sort_range(&s, 0, v->length);
+	CHECK(v);
+	return true;
+}
+
+/* LSD radix sort, a byte at a time from the least significant. Keys
+ * are fetched once each, into pairs with the element (as callers see
+ * it) that the passes shuffle between two arrays. Bytes that are the
+ * same in every key get no pass, so small keys cost no more than
+ * their width. At the end a pointer vector takes the pointers back in
+ * order; a vector of values is copied into a fresh array that takes
+ * the place of the old one. */
+
+struct v_radix_pair
+{
+	uint64_t key;
+	void *elt;
+};
 
+bool
+v_radix_sort(vector *v, v_radix_key *keyfn, void *aux)
+{
+	if (!v || !keyfn)
+		return false;
+	size_t n = v->length, size = v->elt_size;
+	if (n < 2)
+		return true;
+	if (n > SIZE_MAX / (2 * sizeof(struct v_radix_pair)))
+		return false;
+	internal_v_unwrap(v);
+	struct v_radix_pair *pairs = internal_malloc(2 * n * sizeof *pairs),
+	                    *src = pairs, *dst = pairs + n;
+	char *elts = v->by_value ? internal_malloc(v->capacity * size) : v->elts;
+	if (!pairs || !elts)
+	{
+		internal_free(pairs);
+		if (v->by_value)
+			internal_free(elts);
+		return false;
+	}
+
+	/* counts for every byte position in one go */
+	size_t counts[sizeof(uint64_t)][256] = {{0}};
+	for (size_t i = 0; i < n; i++)
+	{
+		void *elt = internal_v_elt(v, i);
+		uint64_t key = keyfn(elt, aux);
+		src[i] = (struct v_radix_pair){.key = key, .elt = elt};
+		for (size_t b = 0; b < sizeof key; b++)
+			counts[b][(key >> 8*b) & 0xff]++;
+	}
+	for (size_t b = 0; b < sizeof(uint64_t); b++)
+	{
+		size_t *count = counts[b], pos = 0;
+		if (count[(src[0].key >> 8*b) & 0xff] == n)
+			continue;
+		for (size_t d = 0; d < 256; d++)
+		{
+			size_t c = count[d];
+			count[d] = pos;
+			pos += c;
+		}
+		for (size_t i = 0; i < n; i++)
+			dst[count[(src[i].key >> 8*b) & 0xff]++] = src[i];
+		struct v_radix_pair *tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	if (v->by_value)
+	{
+		for (size_t i = 0; i < n; i++)
+			memcpy(elts + i*size, src[i].elt, size);
+		internal_free(v->elts);
+		v->elts = elts;
+	}
+	else
+		for (size_t i = 0; i < n; i++)
+			((void **)elts)[i] = src[i].elt;
+	internal_free(pairs);
 	CHECK(v);
 	return true;
 }
 
+uint64_t
+v_radix_str_prefix(const void *s, void *aux)
+{
+	(void)aux;
+	const unsigned char *c = s;
+	uint64_t key = 0;
+	size_t b = 0;
+	if (c)
+		for (; b < sizeof key && c[b]; b++)
+			key = key << 8 | c[b];
+	for (; b < sizeof key; b++)
+		key <<= 8;
+	return key;
+}
+
 bool
 v_reverse(vector *v)
 {
@@ -289,7 +763,7 @@ v_reverse(vector *v)
 	if (n < 2)
 		return true;
 	for (size_t i = n-1; i >= n/2; i--)
-		SWAP(v->elts[i], v->elts[n-i-1]);
+		internal_v_swap(v, i, n-i-1);
 	CHECK(v);
 	return true;
 }
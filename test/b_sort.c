@@ -0,0 +1,109 @@
+/* Times v_sort against the quicksort it replaced, and v_radix_sort,
+ * on a few input shapes. The old sort is quadratic on most of them,
+ * so keep n modest or be patient: b_sort [n] */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "derp/common.h"
+#include "derp/vector.h"
+
+#define RUNS 5
+
+#define SWAP(x, y) do { void *swaptmp = (x); (x) = (y); (y) = swaptmp; } while (0)
+
+int cmpint(const void *a, const void *b, void *aux)
+{
+	(void)aux;
+	int x = *(int*)a, y = *(int*)b;
+	return (x > y) - (x < y);
+}
+
+uint64_t keyint(const void *x, void *aux)
+{
+	(void)aux;
+	return (uint32_t)*(int*)x ^ 0x80000000u;
+}
+
+/* the previous v_sort, from Bentley */
+void old_quicksort(void **elts, size_t lo, size_t hi, comparator *cmp)
+{
+	size_t i, m = lo;
+	if (lo >= hi)
+		return;
+	for (i = lo+1; i <= hi; i++)
+		if (cmp(elts[i], elts[lo], NULL) < 0)
+		{
+			m++;
+			SWAP(elts[i], elts[m]);
+		}
+	SWAP(elts[lo], elts[m]);
+	if (m > 0)
+		old_quicksort(elts, lo, m-1, cmp);
+	old_quicksort(elts, m+1, hi, cmp);
+}
+
+double since(clock_t start)
+{
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv)
+{
+	size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+	int *vals = malloc(n * sizeof *vals);
+	void **elts = malloc(n * sizeof *elts);
+	vector *v = v_new();
+	if (!vals || !elts || !v)
+		return EXIT_FAILURE;
+	const char *shapes[] = {"random", "sorted", "reversed", "few unique"};
+
+	printf("%zu ints      old (s)   v_sort (s)   v_radix_sort (s)\n", n);
+	for (int shape = 0; shape < 4; shape++)
+	{
+		srand(1);
+		for (size_t i = 0; i < n; i++)
+			vals[i] = shape == 0 ? rand() :
+			          shape == 1 ? (int)i :
+			          shape == 2 ? (int)(n - i) : rand() % 8;
+
+		/* best of a few runs, as timings on a busy machine wander */
+		double old = 0, new = 0, radix = 0;
+		for (int run = 0; run < RUNS; run++)
+		{
+			for (size_t i = 0; i < n; i++)
+				elts[i] = vals + i;
+			clock_t start = clock();
+			if (n > 0)
+				old_quicksort(elts, 0, n-1, cmpint);
+			double t = since(start);
+			if (run == 0 || t < old)
+				old = t;
+
+			v_clear(v);
+			for (size_t i = 0; i < n; i++)
+				v_append(v, vals + i);
+			start = clock();
+			v_sort(v, cmpint, NULL);
+			t = since(start);
+			if (run == 0 || t < new)
+				new = t;
+
+			v_clear(v);
+			for (size_t i = 0; i < n; i++)
+				v_append(v, vals + i);
+			start = clock();
+			v_radix_sort(v, keyint, NULL);
+			t = since(start);
+			if (run == 0 || t < radix)
+				radix = t;
+		}
+		printf("%-12s %9.4f %12.4f %18.4f\n", shapes[shape], old, new, radix);
+	}
+	v_free(v);
+	free(elts);
+	free(vals);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,181 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "derp/common.h"
+#include "derp/chashmap.h"
+
+#ifdef HAVE_BOEHM_GC
+#define GC_THREADS
+#include <gc/leak_detector.h>
+#endif
+
+#define STABLE 1000
+#define CHURN  20000
+#define READERS 4
+
+int ivals[] = {0,1,2,3,4,5,6,7,8,9};
+
+unsigned long djb2hash(const void *x)
+{
+	const char *str = x;
+	unsigned long hash = 5381;
+	int c;
+
+	if (str)
+		while ( (c = *str++) )
+			hash = hash * 33 + c;
+	return hash;
+}
+
+unsigned long ihash(const void *x)
+{
+	return *(const int *)x;
+}
+
+int icmp(const void *a, const void *b, void *aux)
+{
+	(void)aux;
+	return *(int*)a - *(int*)b;
+}
+
+pthread_mutex_t freed_lock = PTHREAD_MUTEX_INITIALIZER;
+size_t freed;
+
+void counting_free(void *x, void *aux)
+{
+	(void)aux;
+	pthread_mutex_lock(&freed_lock);
+	freed++;
+	pthread_mutex_unlock(&freed_lock);
+	free(x);
+}
+
+int *new_int(int i)
+{
+	int *p = malloc(sizeof *p);
+	*p = i;
+	return p;
+}
+
+chashmap *shared;
+pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+int writer_done;
+
+int is_done(void)
+{
+	pthread_mutex_lock(&done_lock);
+	int done = writer_done;
+	pthread_mutex_unlock(&done_lock);
+	return done;
+}
+
+void *reader(void *arg)
+{
+	(void)arg;
+	int k;
+	while (!is_done())
+		for (k = 0; k < STABLE; k++)
+		{
+			int *v = chm_at(shared, &k);
+			/* stable keys are never removed or replaced,
+			 * so their values are safe to read */
+			assert(v && *v == k);
+			int churn = STABLE + k*7 % CHURN;
+			/* churned values may be freed at any moment,
+			 * so only look at the pointer */
+			(void)chm_at(shared, &churn);
+		}
+	return NULL;
+}
+
+void *writer(void *arg)
+{
+	(void)arg;
+	for (int round = 0; round < 3; round++)
+	{
+		for (int k = STABLE; k < STABLE+CHURN; k++)
+			assert(chm_insert(shared, new_int(k), new_int(k)));
+		/* replace a value, which retires the old one */
+		for (int k = STABLE; k < STABLE+CHURN; k += 10)
+		{
+			int *key = new_int(k);
+			assert(chm_insert(shared, key, new_int(-k)));
+			free(key); /* the map keeps its existing key */
+		}
+		for (int k = STABLE; k < STABLE+CHURN; k++)
+			assert(chm_remove(shared, &k));
+	}
+	pthread_mutex_lock(&done_lock);
+	writer_done = 1;
+	pthread_mutex_unlock(&done_lock);
+	return NULL;
+}
+
+int main(void)
+{
+#ifdef HAVE_BOEHM_GC
+	GC_set_find_leak(1);
+	derp_use_alloc_funcs(
+		GC_debug_malloc_replacement,
+		GC_debug_realloc_replacement, GC_debug_free);
+#endif
+
+	chashmap *h = chm_new(0, djb2hash, derp_strcmp, NULL);
+	assert(chm_length(h) == 0);
+	assert(chm_is_empty(h));
+
+	assert(!chm_at(h, "zero"));
+	chm_insert(h, "zero", ivals);
+	assert(chm_length(h) == 1);
+	assert(*(int*)chm_at(h, "zero") == 0);
+
+	/* change it */
+	chm_insert(h, "zero", ivals+1);
+	assert(chm_length(h) == 1);
+	assert(*(int*)chm_at(h, "zero") == 1);
+	/* set it back */
+	chm_insert(h, "zero", ivals);
+	assert(*(int*)chm_at(h, "zero") == 0);
+
+	chm_insert(h, "one", ivals+1);
+	assert(chm_length(h) == 2);
+	assert(*(int*)chm_at(h, "one") == 1);
+	assert(!chm_at(h, "flurgle"));
+
+	assert(chm_remove(h, "one"));
+	assert(!chm_remove(h, "one"));
+	assert(!chm_at(h, "one"));
+
+	chm_clear(h);
+	assert(chm_length(h) == 0);
+	assert(!chm_at(h, "zero"));
+	chm_free(h);
+
+	/* readers race a writer that grows the table,
+	 * replaces values, and removes keys */
+	shared = chm_new(0, ihash, icmp, NULL);
+	chm_dtor(shared, counting_free, counting_free, NULL);
+	for (int k = 0; k < STABLE; k++)
+		assert(chm_insert(shared, new_int(k), new_int(k)));
+
+	pthread_t r[READERS], w;
+	for (int i = 0; i < READERS; i++)
+		pthread_create(&r[i], NULL, reader, NULL);
+	pthread_create(&w, NULL, writer, NULL);
+	pthread_join(w, NULL);
+	for (int i = 0; i < READERS; i++)
+		pthread_join(r[i], NULL);
+
+	assert(chm_length(shared) == STABLE);
+	chm_free(shared);
+	/* every key and value, including replaced values,
+	 * was destroyed exactly once */
+	assert(freed == 2*STABLE + 3*(2*CHURN + CHURN/10));
+
+#ifdef HAVE_BOEHM_GC
+	CHECK_LEAKS();
+#endif
+	return 0;
+}
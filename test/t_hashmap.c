@@ -1,4 +1,7 @@
 #include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -23,6 +26,46 @@ unsigned long djb2hash(const void *x)
 	return hash;
 }
 
+/* deliberately poor, to make keys collide within groups */
+unsigned long identity_hash(const void *x)
+{
+	return *(const int *)x;
+}
+
+/* as bad as it gets */
+unsigned long constant_hash(const void *x)
+{
+	(void)x;
+	return 42;
+}
+
+/* counts live in the value pointer itself */
+void *increment(void *val, void *aux)
+{
+	(void)aux;
+	return (void*)((uintptr_t)val + 1);
+}
+
+int icmp(const void *a, const void *b, void *aux)
+{
+	(void)aux;
+	return *(int*)a - *(int*)b;
+}
+
+size_t hash_calls, cmp_calls;
+
+unsigned long counting_hash(const void *x)
+{
+	hash_calls++;
+	return djb2hash(x);
+}
+
+int counting_strcmp(const void *a, const void *b, void *aux)
+{
+	cmp_calls++;
+	return derp_strcmp(a, b, aux);
+}
+
 int main(void)
 {
 #ifdef HAVE_BOEHM_GC
@@ -67,6 +110,12 @@ int main(void)
 	hm_iter_free(i);
 	assert(n_keys == 2);
 
+	hm_iter it;
+	hm_iter_init(&it, h);
+	for (n_keys = 0; hm_iter_next(&it); n_keys++)
+		;
+	assert(n_keys == 2);
+
 	hm_remove(h, "one");
 	assert(!hm_at(h, "one"));
 
@@ -99,6 +148,194 @@ int main(void)
 	hm_iter_free(i);
 	hm_free(h1);
 
+	/* enough keys to grow the table several times */
+	static int many[5000];
+	hashmap *h2 = hm_new(1, identity_hash, icmp, NULL);
+	for (int k = 0; k < 5000; k++)
+	{
+		many[k] = k;
+		assert(hm_insert(h2, many+k, many+k));
+	}
+	assert(hm_length(h2) == 5000);
+	for (int k = 0; k < 5000; k++)
+		assert(hm_at(h2, many+k) == many+k);
+
+	/* churn to leave tombstones behind */
+	for (int round = 0; round < 4; round++)
+	{
+		for (int k = round % 2; k < 5000; k += 2)
+			assert(hm_remove(h2, many+k));
+		assert(hm_length(h2) == 2500);
+		for (int k = round % 2; k < 5000; k += 2)
+			assert(!hm_at(h2, many+k));
+		for (int k = (round+1) % 2; k < 5000; k += 2)
+			assert(hm_at(h2, many+k) == many+k);
+		for (int k = round % 2; k < 5000; k += 2)
+			assert(hm_insert(h2, many+k, many+k));
+		assert(hm_length(h2) == 5000);
+	}
+	/* equal keys needn't be the same pointer */
+	assert(hm_remove(h2, ivals+0));
+	assert(!hm_remove(h2, ivals+0));
+	assert(hm_length(h2) == 4999);
+	for (n_keys = 0, i = hm_iter_begin(h2); (p = hm_iter_next(i)); n_keys++)
+		assert(p->k == p->v);
+	hm_iter_free(i);
+	assert((size_t)n_keys == hm_length(h2));
+
+	/* mass removal shrinks the table as it goes, and
+	 * survivors must stay visible throughout */
+	for (int k = 1; k < 5000; k++)
+	{
+		assert(hm_remove(h2, many+k));
+		if (k % 97 == 0)
+			for (int j = k+1; j < 5000; j += 101)
+				assert(hm_at(h2, many+j) == many+j);
+	}
+	assert(hm_is_empty(h2));
+	struct hm_stats st;
+	assert(hm_stats(h2, &st));
+	assert(st.length == 0 && st.capacity < 100);
+	for (int k = 0; k < 5000; k++)
+		assert(hm_insert(h2, many+k, many+k));
+
+	assert(hm_stats(h2, &st));
+	assert(st.length == 5000);
+	assert(st.load_factor > 0.1 && st.load_factor <= 0.875);
+	size_t hist_total = 0;
+	for (size_t b = 0; b < HM_PROBE_HIST_LEN; b++)
+		hist_total += st.probe_hist[b];
+	assert(hist_total == 5000);
+	assert(st.max_probe >= 1);
+	assert(st.cmps_per_hit >= 1.0 && st.cmps_per_hit < 1.5);
+	for (int k = 0; k < 5000; k++)
+		assert(hm_at(h2, many+k) == many+k);
+	hm_clear(h2);
+	assert(hm_is_empty(h2));
+	assert(!hm_at(h2, many+1));
+
+	assert(hm_reserve(h2, 5000));
+	for (int k = 0; k < 5000; k++)
+		assert(hm_insert(h2, many+k, many+k));
+	assert(hm_length(h2) == 5000);
+	hm_free(h2);
+
+	/* stats expose a degenerate hash */
+	hashmap *h3 = hm_new(0, constant_hash, icmp, NULL);
+	for (int k = 0; k < 100; k++)
+		hm_insert(h3, many+k, many+k);
+	assert(hm_stats(h3, &st));
+	assert(st.max_probe >= 100 / 16);
+	assert(st.cmps_per_hit > 10);
+	assert(st.probe_hist[0] == 16);
+	hm_free(h3);
+
+	/* hashes are cached, so growing doesn't call hashfn again,
+	 * and a mismatched hash skips the comparator */
+	static char names[2000][8];
+	hashmap *h4 = hm_new(1, counting_hash, counting_strcmp, NULL);
+	for (int k = 0; k < 2000; k++)
+	{
+		sprintf(names[k], "%d", k);
+		many[k] = k;
+	}
+	hash_calls = cmp_calls = 0;
+	for (int k = 0; k < 2000; k++)
+		hm_insert(h4, names[k], many+k);
+	assert(hash_calls == 2000);
+	assert(cmp_calls == 0);
+	for (int k = 0; k < 2000; k++)
+		assert(hm_at(h4, names[k]) == many+k);
+	assert(cmp_calls == 2000);
+	hm_free(h4);
+
+	/* batches, including a partial one and missing keys */
+	void *bkeys[100], *bvals[100], *found[100];
+	hashmap *h5 = hm_new(0, identity_hash, icmp, NULL);
+	for (int k = 0; k < 100; k++)
+	{
+		bkeys[k] = many+k;
+		bvals[k] = many+(99-k);
+	}
+	assert(hm_insert_many(h5, bkeys, bvals, 50) == 50);
+	assert(hm_length(h5) == 50);
+	assert(hm_at_many(h5, bkeys, 100, found) == 50);
+	for (int k = 0; k < 100; k++)
+		assert(found[k] == (k < 50 ? bvals[k] : NULL));
+	/* overwrite existing and add the rest */
+	assert(hm_insert_many(h5, bkeys, bkeys, 100) == 100);
+	assert(hm_at_many(h5, bkeys, 100, found) == 100);
+	for (int k = 0; k < 100; k++)
+		assert(found[k] == bkeys[k]);
+	assert(hm_at_many(h5, bkeys, 0, found) == 0);
+	hm_free(h5);
+
+	/* upserts */
+	hashmap *hc = hm_new(0, derp_hash_str, derp_strcmp, NULL);
+	bool inserted;
+	void **slot = hm_get_or_insert(hc, "zero", &inserted);
+	assert(slot && inserted && *slot == NULL);
+	*slot = ivals;
+	slot = hm_get_or_insert(hc, "zero", &inserted);
+	assert(slot && !inserted && *slot == ivals);
+	assert(hm_length(hc) == 1);
+	const char *words[] = {"a", "b", "a", "c", "a", "b"};
+	for (size_t w = 0; w < 6; w++)
+		assert(hm_update(hc, (void*)words[w], increment, NULL));
+	assert((uintptr_t)hm_at(hc, "a") == 3);
+	assert((uintptr_t)hm_at(hc, "b") == 2);
+	assert((uintptr_t)hm_at(hc, "c") == 1);
+	assert(hm_length(hc) == 4);
+	hm_free(hc);
+
+	/* built-in hash functions */
+	assert(derp_hash_seed() == derp_hash_seed());
+	uint64_t seed = derp_hash_seed();
+	unsigned long zero = derp_hash_str("zero");
+	derp_hash_set_seed(seed + 1);
+	assert(derp_hash_seed() == seed + 1 && derp_hash_str("zero") != zero);
+	derp_hash_set_seed(seed);
+	assert(derp_hash_str("zero") == zero);
+	assert(derp_hash_str("zero") == derp_hash_str("zero"));
+	assert(derp_hash_str("zero") != derp_hash_str("one"));
+	assert(derp_hash_bytes("abc", 3, 1) != derp_hash_bytes("abc", 3, 2));
+	assert(derp_hash_bytes("abc", 3, 1) != derp_hash_bytes("abd", 3, 1));
+	assert(derp_hash_bytes("", 0, 1) == derp_hash_bytes("x", 0, 1));
+	/* every length path: short, medium, and the 48-byte loop */
+	char long_key[200];
+	memset(long_key, 'a', sizeof long_key);
+	for (size_t len = 1; len < sizeof long_key; len++)
+		assert(derp_hash_bytes(long_key, len, 7) !=
+		       derp_hash_bytes(long_key, len-1, 7));
+
+	hashmap *hs = hm_new(0, derp_hash_str, derp_strcmp, NULL);
+	for (int k = 0; k < 2000; k++)
+		hm_insert(hs, names[k], many+k);
+	for (int k = 0; k < 2000; k++)
+		assert(hm_at(hs, names[k]) == many+k);
+	assert(hm_stats(hs, &st));
+	assert(st.cmps_per_hit == 1.0);
+	hm_free(hs);
+
+	static uint64_t wide[1000];
+	hashmap *hu = hm_new(0, derp_hash_u64, derp_u64cmp, NULL);
+	for (int k = 0; k < 1000; k++)
+	{
+		wide[k] = (uint64_t)k << 40;
+		hm_insert(hu, wide+k, many+k);
+	}
+	uint64_t probe = (uint64_t)999 << 40;
+	assert(hm_at(hu, &probe) == many+999);
+	assert(derp_u64cmp(wide+1, wide+2, NULL) < 0);
+	hm_free(hu);
+
+	hashmap *hp = hm_new(0, derp_hash_ptr, derp_ptrcmp, NULL);
+	for (int k = 0; k < 1000; k++)
+		hm_insert(hp, many+k, wide+k);
+	assert(hm_at(hp, many+500) == wide+500);
+	assert(!hm_at(hp, wide));
+	hm_free(hp);
+
 #ifdef HAVE_BOEHM_GC
 	CHECK_LEAKS();
 #endif
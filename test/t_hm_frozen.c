@@ -0,0 +1,131 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "derp/common.h"
+#include "derp/hashmap.h"
+#include "derp/hm_frozen.h"
+
+#ifdef HAVE_BOEHM_GC
+#include <gc/leak_detector.h>
+#endif
+
+#define MANY 50000
+
+/* fixed width integers, in the byte order of the machine */
+size_t int_bytes(const void *x, const void **bytes, void *aux)
+{
+	(void)aux;
+	*bytes = x;
+	return sizeof(int);
+}
+
+unsigned long ihash(const void *x)
+{
+	return derp_hash_bytes(x, sizeof(int), 0);
+}
+
+int icmp(const void *a, const void *b, void *aux)
+{
+	(void)aux;
+	return *(int*)a - *(int*)b;
+}
+
+int main(void)
+{
+#ifdef HAVE_BOEHM_GC
+	GC_set_find_leak(1);
+	derp_use_alloc_funcs(
+		GC_debug_malloc_replacement,
+		GC_debug_realloc_replacement, GC_debug_free);
+#endif
+
+	char path[] = "/tmp/t_hm_frozen.XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	hashmap *h = hm_new(0, derp_hash_str, derp_strcmp, NULL);
+	hm_insert(h, "zero", "0");
+	hm_insert(h, "one", "1");
+	hm_insert(h, "", "empty key");
+	hm_insert(h, "null", NULL);
+	assert(hm_freeze(h, path, NULL, NULL, NULL));
+	hm_free(h);
+
+	hm_frozen *f = hm_frozen_open(path);
+	assert(f);
+	assert(hm_frozen_length(f) == 4);
+	size_t len;
+	const char *v = hm_frozen_at(f, "zero", 4, &len);
+	assert(v && len == 1 && strcmp(v, "0") == 0);
+	v = hm_frozen_at(f, "one", 3, NULL);
+	assert(v && strcmp(v, "1") == 0);
+	v = hm_frozen_at(f, "", 0, &len);
+	assert(v && strcmp(v, "empty key") == 0);
+	v = hm_frozen_at(f, "null", 4, &len);
+	assert(v && len == 0 && *v == '\0');
+	/* prefixes and other lengths aren't matches */
+	assert(!hm_frozen_at(f, "zer", 3, NULL));
+	assert(!hm_frozen_at(f, "zero", 5, NULL));
+	assert(!hm_frozen_at(f, "flurgle", 7, NULL));
+	hm_frozen_close(f);
+
+	/* lots of binary keys */
+	static int keys[MANY], vals[MANY];
+	h = hm_new(0, ihash, icmp, NULL);
+	for (int i = 0; i < MANY; i++)
+	{
+		keys[i] = i * 7919;
+		vals[i] = -i;
+		assert(hm_insert(h, keys+i, vals+i));
+	}
+	assert(hm_freeze(h, path, int_bytes, int_bytes, NULL));
+	hm_free(h);
+	f = hm_frozen_open(path);
+	assert(f && hm_frozen_length(f) == MANY);
+	for (int i = 0; i < MANY; i++)
+	{
+		int k = i * 7919;
+		const int *val = hm_frozen_at(f, &k, sizeof k, &len);
+		assert(val && len == sizeof(int));
+		int copy;
+		memcpy(&copy, val, sizeof copy);
+		assert(copy == -i);
+		k++;
+		assert(!hm_frozen_at(f, &k, sizeof k, NULL));
+	}
+	hm_frozen_close(f);
+
+	/* an empty map is still a valid file */
+	h = hm_new(0, derp_hash_str, derp_strcmp, NULL);
+	assert(hm_freeze(h, path, NULL, NULL, NULL));
+	hm_free(h);
+	f = hm_frozen_open(path);
+	assert(f && hm_frozen_length(f) == 0);
+	assert(!hm_frozen_at(f, "zero", 4, NULL));
+	hm_frozen_close(f);
+
+	/* files that aren't frozen maps */
+	FILE *fp = fopen(path, "wb");
+	assert(fp);
+	fputs("not a frozen hashmap, just some text", fp);
+	fclose(fp);
+	assert(!hm_frozen_open(path));
+	fp = fopen(path, "wb");
+	assert(fp);
+	fclose(fp);
+	assert(!hm_frozen_open(path));
+	unlink(path);
+	assert(!hm_frozen_open(path));
+
+#ifdef HAVE_BOEHM_GC
+	CHECK_LEAKS();
+#endif
+	return 0;
+}
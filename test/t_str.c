@@ -0,0 +1,88 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "derp/common.h"
+#include "derp/hashmap.h"
+#include "derp/str.h"
+#include "derp/treemap.h"
+
+#ifdef HAVE_BOEHM_GC
+#include <gc/leak_detector.h>
+#endif
+
+int ivals[] = {0,1,2,3,4,5,6,7,8,9};
+
+const char *long_text =
+	"a string well past the inline limit, so it lives on the heap";
+
+int main(void)
+{
+#ifdef HAVE_BOEHM_GC
+	GC_set_find_leak(1);
+	derp_use_alloc_funcs(
+		GC_debug_malloc_replacement,
+		GC_debug_realloc_replacement, GC_debug_free);
+#endif
+
+	derp_str *s = derp_str_new("zero", 4);
+	assert(derp_str_len(s) == 4);
+	assert(strcmp(derp_str_data(s), "zero") == 0);
+
+	derp_str *l = derp_str_new(long_text, strlen(long_text));
+	assert(derp_str_len(l) == strlen(long_text));
+	assert(strcmp(derp_str_data(l), long_text) == 0);
+	assert(derp_str_data(l) != long_text); /* copied */
+
+	/* stack keys borrow long strings instead of copying */
+	derp_str k;
+	derp_str_init(&k, long_text, strlen(long_text));
+	assert(derp_str_data(&k) == long_text);
+	assert(derp_str_hash(&k) == derp_str_hash(l));
+	assert(derp_str_eq(&k, l, NULL) == 0);
+	assert(derp_str_cmp(&k, l, NULL) == 0);
+
+	/* embedded NULs count, lengths decide prefixes */
+	derp_str a, b, c;
+	derp_str_init(&a, "ab\0c", 4);
+	derp_str_init(&b, "ab\0d", 4);
+	derp_str_init(&c, "ab", 2);
+	assert(derp_str_eq(&a, &b, NULL) != 0);
+	assert(derp_str_cmp(&a, &b, NULL) < 0);
+	assert(derp_str_cmp(&c, &a, NULL) < 0);
+	assert(derp_str_cmp(&a, &c, NULL) > 0);
+	assert(derp_str_eq(&c, &a, NULL) != 0);
+
+	hashmap *h = hm_new(0, derp_str_hash, derp_str_eq, NULL);
+	hm_dtor(h, derp_str_free, NULL, NULL);
+	hm_insert(h, s, ivals);
+	hm_insert(h, l, ivals+1);
+	derp_str_init(&k, "zero", 4);
+	assert(*(int*)hm_at(h, &k) == 0);
+	derp_str_init(&k, long_text, strlen(long_text));
+	assert(*(int*)hm_at(h, &k) == 1);
+	derp_str_init(&k, "flurgle", 7);
+	assert(!hm_at(h, &k));
+	hm_free(h);
+
+	/* ordered by bytes, then by length */
+	treemap *t = tm_new(derp_str_cmp, NULL);
+	tm_dtor(t, derp_str_free, NULL, NULL);
+	const char *words[] = {"d", "a", "ca", "c", "b"};
+	for (size_t i = 0; i < 5; i++)
+		tm_insert(t, derp_str_new(words[i], strlen(words[i])), ivals+i);
+	tm_iter *i = tm_iter_begin(t);
+	const char *order[] = {"a", "b", "c", "ca", "d"};
+	for (size_t j = 0; j < 5; j++)
+		assert(strcmp(derp_str_data(tm_iter_next(i)->k), order[j]) == 0);
+	assert(!tm_iter_next(i));
+	tm_iter_free(i);
+	derp_str_init(&k, "ca", 2);
+	assert(*(int*)tm_at(t, &k) == 2);
+	tm_free(t);
+
+#ifdef HAVE_BOEHM_GC
+	CHECK_LEAKS();
+#endif
+	return 0;
+}
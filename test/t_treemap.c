@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -17,6 +19,304 @@ int icmp(const void *a, const void *b, void *aux)
 	return *(int*)a - *(int*)b;
 }
 
+/* counts live in the value pointer itself */
+void *increment(void *val, void *aux)
+{
+	(void)aux;
+	return (void*)((uintptr_t)val + 1);
+}
+
+/* allocates a replacement, so the old value gets destroyed */
+void *increment_int(void *val, void *aux)
+{
+	(void)aux;
+	int *n = malloc(sizeof *n);
+	*n = val ? *(int*)val + 1 : 1;
+	return n;
+}
+
+int destroyed;
+
+void count_free(void *p, void *aux)
+{
+	(void)aux;
+	destroyed++;
+	free(p);
+}
+
+int *new_int(int i)
+{
+	int *p = malloc(sizeof *p);
+	*p = i;
+	return p;
+}
+
+#define CHURN 5000
+
+/* random inserts, replacements and removals checked against a
+ * plain array, with keys the tree owns so any stale pointer it
+ * keeps to a destroyed key shows up under a sanitizer */
+void churn(treemap *t)
+{
+	static bool present[CHURN];
+	size_t length = 0;
+	memset(present, 0, sizeof present);
+	tm_dtor(t, derp_free, derp_free, NULL);
+	srand(1);
+	for (int round = 0; round < 20*CHURN; round++)
+	{
+		int k = rand() % CHURN;
+		if (rand() % 3)
+		{
+			assert(tm_insert(t, new_int(k), new_int(-k)));
+			if (!present[k])
+				length++;
+			present[k] = true;
+		}
+		else
+		{
+			assert(tm_remove(t, &k) == present[k]);
+			if (present[k])
+				length--;
+			present[k] = false;
+		}
+	}
+	assert(tm_length(t) == length);
+	int prev = -1;
+	size_t seen = 0;
+	tm_iter it;
+	struct map_pair *p;
+	for (tm_iter_init(&it, t); (p = tm_iter_next(&it)); seen++)
+	{
+		int k = *(int*)p->k;
+		assert(k > prev && present[k] && *(int*)p->v == -k);
+		prev = k;
+	}
+	assert(seen == length);
+	size_t below = 0;
+	for (int k = 0; k < CHURN; k++)
+	{
+		assert(!tm_at(t, &k) == !present[k]);
+		assert(tm_rank(t, &k) == below);
+		if (present[k])
+			assert(*(int*)tm_select(t, below++)->k == k);
+	}
+	assert(!tm_select(t, length));
+
+	/* bounds, checked against the nearest present keys */
+	for (int k = -1; k <= CHURN; k++)
+	{
+		int lo = k < CHURN ? k : CHURN-1, hi = k;
+		while (lo >= 0 && !present[lo])
+			lo--;
+		while (hi < CHURN && (hi < 0 || !present[hi]))
+			hi++;
+		struct map_pair *f = tm_floor(t, &k), *c = tm_ceiling(t, &k),
+		                *lb = tm_lower_bound(t, &k),
+		                *ub = tm_upper_bound(t, &k);
+		assert(lo < 0 ? !f : *(int*)f->k == lo);
+		assert(hi == CHURN ? !c : *(int*)c->k == hi);
+		assert(c == lb);
+		int after = k + 1;
+		while (after < CHURN && !present[after])
+			after++;
+		assert(after >= CHURN ? !ub : *(int*)ub->k == after);
+	}
+
+	/* ranges are half open */
+	int from = CHURN/4, to = CHURN/2;
+	size_t in_range = 0;
+	for (int k = from; k < to; k++)
+		in_range += present[k];
+	seen = 0;
+	for (tm_iter_range(&it, t, &from, &to); (p = tm_iter_next(&it)); seen++)
+		assert(*(int*)p->k >= from && *(int*)p->k < to);
+	assert(seen == in_range);
+	assert(!tm_iter_next(&it));
+	/* open ends */
+	for (seen = 0, tm_iter_range(&it, t, NULL, &to); tm_iter_next(&it); )
+		seen++;
+	assert(seen == tm_rank(t, &to));
+	for (seen = 0, tm_iter_range(&it, t, &to, NULL); tm_iter_next(&it); )
+		seen++;
+	assert(seen == length - tm_rank(t, &to));
+	/* backward, from either end or the middle of a range */
+	int lo = 0, hi = CHURN-1;
+	while (!present[lo])
+		lo++;
+	while (!present[hi])
+		hi--;
+	assert(*(int*)tm_first(t)->k == lo && *(int*)tm_last(t)->k == hi);
+	prev = CHURN;
+	seen = 0;
+	for (tm_iter_init_end(&it, t); (p = tm_iter_prev(&it)); seen++)
+	{
+		assert(*(int*)p->k < prev);
+		prev = *(int*)p->k;
+	}
+	assert(seen == length && prev == lo);
+	assert(!tm_iter_prev(&it));
+	assert(*(int*)tm_iter_next(&it)->k == lo);
+	tm_iter_init(&it, t);
+	assert(!tm_iter_prev(&it));
+	/* to the end of the range, back to its start, and past neither */
+	tm_iter_range(&it, t, &from, &to);
+	for (seen = 0; (p = tm_iter_next(&it)); seen++)
+		;
+	assert(seen == in_range);
+	for (seen = 0; (p = tm_iter_prev(&it)); seen++)
+		assert(*(int*)p->k >= from && *(int*)p->k < to);
+	assert(seen == in_range);
+	p = tm_iter_next(&it);
+	assert(p == tm_lower_bound(t, &from));
+	/* zigzag: each step back returns what the step forward did */
+	tm_iter_init(&it, t);
+	for (size_t k = 0; k < length; k++)
+	{
+		p = tm_iter_next(&it);
+		assert(tm_iter_prev(&it) == p && tm_iter_next(&it) == p);
+		assert(p == tm_select(t, k));
+	}
+	assert(!tm_iter_next(&it));
+	assert(tm_iter_prev(&it) == tm_last(t));
+
+	/* shrink all the way down, then grow again */
+	for (int k = 0; k < CHURN; k++)
+		if (present[k])
+			assert(tm_remove(t, &k));
+	assert(tm_is_empty(t));
+	for (int k = 0; k < CHURN; k++)
+		assert(tm_insert(t, new_int(k), new_int(-k)));
+	tm_clear(t);
+	assert(tm_is_empty(t));
+	assert(!tm_first(t) && !tm_last(t));
+	tm_iter_init(&it, t);
+	assert(!tm_iter_next(&it));
+	tm_iter_init_end(&it, t);
+	assert(!tm_iter_prev(&it));
+	assert(tm_insert(t, new_int(1), new_int(-1)));
+	assert(*(int*)tm_at(t, &(int){1}) == -1);
+}
+
+/* values are counts in the pointer itself */
+void *add(void *a, void *b, void *aux)
+{
+	(void)aux;
+	return (void*)((uintptr_t)a + (uintptr_t)b);
+}
+
+static int sorted[2*CHURN];
+
+/* bulk loads: evens from scratch, odds merged in, then a few
+ * stragglers that go in one at a time. A null make means
+ * tm_from_sorted */
+void bulk(treemap *(*make)(comparator *, void *))
+{
+	static struct map_pair batch[CHURN];
+	treemap *t;
+
+	for (int k = 0; k < 2*CHURN; k++)
+		sorted[k] = k;
+	for (int k = 0; k < CHURN; k++)
+		batch[k] = (struct map_pair){sorted + 2*k, ivals};
+	if (make)
+	{
+		t = make(icmp, NULL);
+		assert(tm_insert_sorted(t, batch, 0) && tm_is_empty(t));
+		assert(tm_insert_sorted(t, batch, CHURN));
+	}
+	else
+		t = tm_from_sorted(batch, CHURN, icmp, NULL);
+	assert(tm_length(t) == CHURN);
+	for (int k = 0; k < CHURN; k++)
+		batch[k] = (struct map_pair){sorted + 2*k+1, ivals+1};
+	/* one key already there, to be replaced */
+	batch[0] = (struct map_pair){sorted, ivals+2};
+	assert(tm_insert_sorted(t, batch, CHURN));
+	assert(tm_length(t) == 2*CHURN - 1);
+	assert(tm_at(t, sorted) == ivals+2);
+	assert(!tm_at(t, sorted+1));
+	batch[0] = (struct map_pair){sorted+1, ivals+1};
+	assert(tm_insert_sorted(t, batch, 1));
+	assert(tm_insert_sorted(t, batch, 0));
+	assert(*(int*)tm_first(t)->k == 0 && *(int*)tm_last(t)->k == 2*CHURN-1);
+	for (int k = 0; k < 2*CHURN; k++)
+	{
+		assert(*(int*)tm_select(t, k)->k == k);
+		assert(tm_at(t, sorted+k) == (k == 0 ? ivals+2 : ivals + k%2));
+	}
+	/* still balanced enough to keep working */
+	for (int k = 0; k < 2*CHURN; k += 3)
+		assert(tm_remove(t, sorted+k));
+	for (int k = 0; k < 2*CHURN; k++)
+		assert(!tm_at(t, sorted+k) == (k%3 == 0));
+	for (int k = 0; k < 2*CHURN; k++)
+		if (k%3)
+			assert(tm_remove(t, sorted+k));
+	assert(tm_is_empty(t));
+	tm_free(t);
+	if (!make)
+	{
+		assert((t = tm_from_sorted(NULL, 0, icmp, NULL)) && tm_is_empty(t));
+		tm_free(t);
+	}
+}
+
+#define SETOP 3000
+
+/* multiples of 2 and of 3 below SETOP, combined every way, with
+ * each backend on either side */
+void setops(treemap *(*make_dst)(comparator *, void *),
+            treemap *(*make_src)(comparator *, void *))
+{
+	static int keys[SETOP];
+	for (int k = 0; k < SETOP; k++)
+		keys[k] = k;
+	for (int op = 0; op < 3; op++)
+	{
+		treemap *dst = make_dst(icmp, NULL), *src = make_src(icmp, NULL);
+		for (int k = 0; k < SETOP; k += 2)
+			assert(tm_insert(dst, keys+k, (void*)1));
+		for (int k = 0; k < SETOP; k += 3)
+			assert(tm_insert(src, keys+k, (void*)2));
+		bool ok = op == 0 ? tm_union(dst, src, add, NULL) :
+		          op == 1 ? tm_intersection(dst, src, NULL, NULL) :
+		                    tm_difference(dst, src);
+		assert(ok);
+		size_t want = 0;
+		for (int k = 0; k < SETOP; k++)
+		{
+			bool two = k % 2 == 0, three = k % 3 == 0;
+			uintptr_t v = (uintptr_t)tm_at(dst, keys+k);
+			if (op == 0)
+				assert(v == (two ? 1u : 0) + (three ? 2u : 0));
+			else if (op == 1)
+				assert(v == (two && three ? 1u : 0));
+			else
+				assert(v == (two && !three ? 1u : 0));
+			want += v != 0;
+		}
+		assert(tm_length(dst) == want);
+		assert(tm_length(src) == (SETOP+2)/3);
+		tm_iter it;
+		struct map_pair *p;
+		int prev = -1;
+		for (tm_iter_init(&it, dst); (p = tm_iter_next(&it)); )
+		{
+			assert(*(int*)p->k > prev);
+			prev = *(int*)p->k;
+		}
+		/* and still a sound tree */
+		for (size_t k = 0; k < want; k++)
+			assert(tm_select(dst, k));
+		for (int k = 0; k < SETOP; k++)
+			tm_remove(dst, keys+k);
+		assert(tm_is_empty(dst));
+		tm_free(dst);
+		tm_free(src);
+	}
+}
+
 int main(void)
 {
 #ifdef HAVE_BOEHM_GC
@@ -49,7 +349,8 @@ int main(void)
 	assert(*(int*)tm_at(t, "one") == 1);
 	assert(!tm_at(t, "flurgle"));
 
-	tm_remove(t, "one");
+	assert(tm_remove(t, "one"));
+	assert(!tm_remove(t, "one"));
 	assert(!tm_at(t, "one"));
 
 	tm_clear(t);
@@ -126,6 +427,200 @@ int main(void)
 
 	tm_free(t2);
 
+	/* upserts */
+	treemap *tc = tm_new(derp_strcmp, NULL);
+	bool inserted;
+	void **slot = tm_get_or_insert(tc, "zero", &inserted);
+	assert(slot && inserted && *slot == NULL);
+	*slot = ivals;
+	slot = tm_get_or_insert(tc, "zero", &inserted);
+	assert(slot && !inserted && *slot == ivals);
+	assert(tm_length(tc) == 1);
+	const char *words[] = {"a", "b", "a", "c", "a", "b"};
+	for (size_t w = 0; w < 6; w++)
+		assert(tm_update(tc, (void*)words[w], increment, NULL));
+	assert((uintptr_t)tm_at(tc, "a") == 3);
+	assert((uintptr_t)tm_at(tc, "b") == 2);
+	assert((uintptr_t)tm_at(tc, "c") == 1);
+	assert(tm_length(tc) == 4);
+	tm_free(tc);
+
+	/* replaced values are destroyed, existing keys kept */
+	treemap *td = tm_new(derp_strcmp, NULL);
+	tm_dtor(td, NULL, derp_free, NULL);
+	int *first = malloc(sizeof *first);
+	*first = 1;
+	tm_insert(td, "k", first);
+	assert(tm_update(td, "k", increment_int, NULL));
+	assert(*(int*)tm_at(td, "k") == 2);
+	tm_free(td);
+
+	/* iterator on the stack, over a deep tree */
+	treemap *te = tm_new(icmp, NULL);
+	int many[4096];
+	for (int k = 0; k < 4096; k++)
+	{
+		many[k] = 4095 - k;
+		tm_insert(te, many+k, NULL);
+	}
+	tm_iter it;
+	tm_iter_init(&it, te);
+	int expect = 0;
+	struct map_pair *pair;
+	while ((pair = tm_iter_next(&it)))
+		assert(*(int*)pair->k == expect++);
+	assert(expect == 4096);
+	assert(!tm_iter_next(&it));
+	/* a miss changes nothing, then drain it from the smallest up */
+	int absent = 4096;
+	assert(!tm_remove(te, &absent));
+	assert(tm_length(te) == 4096);
+	for (int k = 4095; k >= 0; k--)
+	{
+		assert(tm_remove(te, many+k));
+		assert(tm_length(te) == (size_t)k);
+		if (k > 0)
+			assert(*(int*)tm_select(te, 0)->k == 4096-k);
+	}
+	assert(tm_is_empty(te));
+	tm_free(te);
+
+	treemap *tf = tm_new(icmp, NULL);
+	churn(tf);
+	tm_free(tf);
+
+	bulk(NULL);
+	bulk(tm_new);
+	bulk(tm_new_btree);
+
+	/* snapshots don't see later changes */
+	tf = tm_new(icmp, NULL);
+	for (int k = 0; k < 2*CHURN; k += 2)
+		assert(tm_insert(tf, sorted+k, ivals));
+	treemap *snap = tm_snapshot(tf);
+	assert(snap && tm_length(snap) == CHURN);
+	for (int k = 0; k < 2*CHURN; k++)
+	{
+		if (k % 2)
+			assert(tm_insert(tf, sorted+k, ivals+1));
+		else if (k % 3 == 0)
+			assert(tm_remove(tf, sorted+k));
+		else
+			assert(tm_insert(tf, sorted+k, ivals+2));
+	}
+	treemap *snap2 = tm_snapshot(tf);
+	tm_clear(tf);
+	assert(tm_is_empty(tf));
+	assert(tm_insert(tf, sorted, ivals+3));
+	assert(tm_length(snap) == CHURN);
+	for (int k = 0; k < 2*CHURN; k++)
+	{
+		assert(tm_at(snap, sorted+k) == (k % 2 ? NULL : ivals));
+		assert(tm_at(snap2, sorted+k) ==
+		       (k % 2 ? ivals+1 : k % 3 ? ivals+2 : NULL));
+	}
+	assert(*(int*)tm_select(snap, 1)->k == 2);
+	/* read only, and outliving the tree */
+	assert(!tm_insert(snap, sorted+1, ivals));
+	assert(!tm_remove(snap, sorted));
+	assert(!tm_get_or_insert(snap, sorted+1, NULL));
+	tm_clear(snap);
+	assert(tm_length(snap) == CHURN);
+	tm_free(tf);
+	treemap *snap3 = tm_snapshot(snap2);
+	tm_free(snap2);
+	assert(tm_at(snap3, sorted+1) == ivals+1);
+	tm_free(snap3);
+	tm_iter_init(&it, snap);
+	for (int k = 0; (pair = tm_iter_next(&it)); k += 2)
+		assert(*(int*)pair->k == k);
+	tm_free(snap);
+
+	setops(tm_new, tm_new);
+	setops(tm_new, tm_new_btree);
+	setops(tm_new_btree, tm_new);
+	setops(tm_new_btree, tm_new_btree);
+
+	/* a map can't combine with itself, but can with its snapshot,
+	 * and dropped pairs are destroyed once the snapshot is gone */
+	tf = tm_new(icmp, NULL);
+	tm_dtor(tf, derp_free, NULL, NULL);
+	for (int k = 0; k < 10; k++)
+		assert(tm_insert(tf, new_int(k), ivals+k));
+	assert(!tm_union(tf, tf, NULL, NULL));
+	snap = tm_snapshot(tf);
+	assert(tm_intersection(tf, snap, NULL, NULL));
+	assert(tm_length(tf) == 10);
+	treemap *evens = tm_new(icmp, NULL);
+	for (int k = 0; k < 10; k += 2)
+		assert(tm_insert(evens, ivals+k, NULL));
+	assert(tm_difference(tf, evens));
+	assert(tm_length(tf) == 5 && !tm_at(tf, ivals+4) && tm_at(tf, ivals+5));
+	assert(tm_length(snap) == 10 && tm_at(snap, ivals+4) == ivals+4);
+	tm_free(snap);
+	tm_free(tf);
+	tf = tm_new_btree(icmp, NULL);
+	tm_dtor(tf, derp_free, NULL, NULL);
+	for (int k = 0; k < 10; k++)
+		assert(tm_insert(tf, new_int(k), ivals+k));
+	assert(tm_difference(tf, evens));
+	assert(tm_length(tf) == 5 && !tm_at(tf, ivals+4) && tm_at(tf, ivals+5));
+	tm_free(evens);
+	tm_free(tf);
+
+	/* destructors wait for the snapshots that can see the pairs */
+	tf = tm_new(icmp, NULL);
+	tm_dtor(tf, NULL, count_free, NULL);
+	for (int k = 0; k < 10; k++)
+		assert(tm_insert(tf, ivals+k, new_int(k)));
+	snap = tm_snapshot(tf);
+	assert(snap);
+	destroyed = 0;
+	assert(tm_remove(tf, ivals));
+	assert(tm_insert(tf, ivals+1, new_int(10)));
+	assert(tm_update(tf, ivals+2, increment_int, NULL));
+	tm_clear(tf);
+	assert(tm_is_empty(tf) && destroyed == 0);
+	for (int k = 0; k < 10; k++)
+		assert(*(int*)tm_at(snap, ivals+k) == k);
+	tm_free(snap);
+	/* the tree notices on its next write */
+	assert(destroyed == 0);
+	assert(tm_insert(tf, ivals, new_int(0)));
+	assert(destroyed == 12);
+	/* and a tree freed first leaves its pairs to the snapshot */
+	snap = tm_snapshot(tf);
+	tm_free(tf);
+	assert(destroyed == 12 && *(int*)tm_at(snap, ivals) == 0);
+	tm_free(snap);
+	assert(destroyed == 13);
+
+	/* B+ tree backend, same interface */
+	treemap *bt = tm_new_btree(derp_strcmp, NULL);
+	assert(tm_is_empty(bt));
+	assert(!tm_at(bt, "zero"));
+	tm_insert(bt, "zero", ivals);
+	tm_insert(bt, "zero", ivals+1);
+	assert(tm_length(bt) == 1);
+	assert(*(int*)tm_at(bt, "zero") == 1);
+	slot = tm_get_or_insert(bt, "one", &inserted);
+	assert(slot && inserted && !*slot);
+	*slot = ivals+1;
+	assert(tm_update(bt, "two", increment, NULL));
+	assert((uintptr_t)tm_at(bt, "two") == 1);
+	assert(tm_remove(bt, "one"));
+	assert(!tm_remove(bt, "one"));
+	assert(tm_length(bt) == 2);
+	tm_free(bt);
+
+	bt = tm_new_btree(icmp, NULL);
+	churn(bt);
+	tm_free(bt);
+
+	bt = tm_new_btree(icmp, NULL);
+	assert(!tm_snapshot(bt));
+	tm_free(bt);
+
 #ifdef HAVE_BOEHM_GC
 	CHECK_LEAKS();
 #endif
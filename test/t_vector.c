@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "derp/common.h"
 #include "derp/vector.h"
@@ -10,6 +11,8 @@
 #endif
 
 #define ARRAY_LEN(a) (sizeof(a)/sizeof(*a))
+#define SORTN 5000
+#define PSORTN 70001
 
 int cmpint(const void *a, const void *b, void *aux)
 {
@@ -17,6 +20,21 @@ int cmpint(const void *a, const void *b, void *aux)
 	return *(int*)a - *(int*)b;
 }
 
+struct point { double x; int label; };
+
+/* order points by label, which may be negative */
+uint64_t label_key(const void *elt, void *aux)
+{
+	(void)aux;
+	return (uint32_t)((const struct point *)elt)->label ^ 0x80000000u;
+}
+
+/* destructor for a vector of points */
+void count_labels(void *elt, void *aux)
+{
+	*(int*)aux += ((struct point *)elt)->label;
+}
+
 int main(void)
 {
 #ifdef HAVE_BOEHM_GC
@@ -113,6 +131,173 @@ int main(void)
 
 	v_free(vint);
 
+	/* values stored inline */
+	struct point pt;
+	vector *vpt = v_new_sized(sizeof pt);
+	assert(vpt && !v_new_sized(0));
+	assert(!v_at(vpt, 0) && !v_remove_last(vpt));
+	for (i = 0; i < 1000; i++)
+	{
+		pt = (struct point){.x = i / 2.0, .label = (int)i};
+		assert(v_append(vpt, &pt));
+	}
+	pt.label = -1;
+	assert(v_length(vpt) == 1000);
+	assert(((struct point *)v_at(vpt, 999))->label == 999);
+	assert(((struct point *)v_first(vpt))->x == 0.0);
+	struct point *gone = v_remove_first(vpt);
+	assert(gone->label == 0 && ((struct point *)v_first(vpt))->label == 1);
+	gone = v_remove(vpt, 10);
+	assert(gone->label == 11 && ((struct point *)v_at(vpt, 10))->label == 12);
+	assert(v_insert(vpt, 10, gone));
+	assert(v_prepend(vpt, NULL));
+	assert(((struct point *)v_first(vpt))->label == 0);
+	assert(v_length(vpt) == 1000);
+	for (i = 0; i < 1000; i++)
+		assert(((struct point *)v_at(vpt, i))->label == (int)i);
+	v_reverse(vpt);
+	assert(((struct point *)v_first(vpt))->label == 999);
+	assert(v_swap(vpt, 0, 999));
+	assert(((struct point *)v_first(vpt))->label == 0);
+	v_clear(vpt);
+
+	vector *vi = v_new_sized(sizeof(int));
+	int shuffled[] = {5,3,9,0,3,7,1};
+	for (i = 0; i < ARRAY_LEN(shuffled); i++)
+		assert(v_append(vi, shuffled+i));
+	assert(v_find_index(vi, ivals+3, cmpint, NULL) == 1);
+	assert(v_find_last_index(vi, ivals+3, cmpint, NULL) == 4);
+	assert(v_sort(vi, cmpint, NULL));
+	for (i = 1; i < v_length(vi); i++)
+		assert(*(int*)v_at(vi, i-1) <= *(int*)v_at(vi, i));
+	assert(v_set_length(vi, 100) && *(int*)v_at(vi, 99) == 0);
+	/* growing keeps the values */
+	assert(v_reserve_capacity(vi, 1 << 16) >= 1 << 16);
+	assert(*(int*)v_last(vi) == 0 && *(int*)v_first(vi) == 0);
+	v_free(vi);
+
+	/* shapes that trip up simpler quicksorts, both kinds of vector */
+	static int keys[SORTN];
+	for (int shape = 0; shape < 5; shape++)
+	{
+		long sum = 0;
+		for (i = 0; i < SORTN; i++)
+		{
+			keys[i] = shape == 0 ? rand() % SORTN :
+			          shape == 1 ? (int)i :
+			          shape == 2 ? (int)(SORTN - i) :
+			          shape == 3 ? rand() % 4 :
+			                       (int)(i < SORTN/2 ? i : SORTN - i);
+			sum += keys[i];
+		}
+		vector *vp = v_new();
+		vi = v_new_sized(sizeof(int));
+		for (i = 0; i < SORTN; i++)
+			assert(v_append(vp, keys+i) && v_append(vi, keys+i));
+		assert(v_sort(vp, cmpint, NULL) && v_sort(vi, cmpint, NULL));
+		for (i = 0; i < SORTN; i++)
+		{
+			int p = *(int*)v_at(vp, i), x = *(int*)v_at(vi, i);
+			assert(p == x);
+			assert(i == 0 || *(int*)v_at(vp, i-1) <= p);
+			sum -= x;
+		}
+		assert(sum == 0);
+		v_free(vp);
+		v_free(vi);
+	}
+
+	/* big enough to be split among threads, and not evenly */
+	static int pkeys[PSORTN];
+	unsigned threads[] = {0, 3, 4};
+	for (i = 0; i < ARRAY_LEN(threads); i++)
+	{
+		vector *vp = v_new();
+		vi = v_new_sized(sizeof(int));
+		for (size_t j = 0; j < PSORTN; j++)
+		{
+			pkeys[j] = rand() % (i == 0 ? 8 : PSORTN);
+			assert(v_append(vp, pkeys+j) && v_append(vi, pkeys+j));
+		}
+		assert(v_sort_parallel(vp, cmpint, NULL, threads[i]));
+		assert(v_sort_parallel(vi, cmpint, NULL, threads[i]));
+		assert(v_length(vp) == PSORTN && v_length(vi) == PSORTN);
+		for (size_t j = 1; j < PSORTN; j++)
+		{
+			assert(*(int*)v_at(vp, j-1) <= *(int*)v_at(vp, j));
+			assert(*(int*)v_at(vi, j) == *(int*)v_at(vp, j));
+		}
+		v_free(vp);
+		v_free(vi);
+	}
+
+	/* radix sorting is stable */
+	vector *vr = v_new_sized(sizeof(struct point));
+	for (i = 0; i < SORTN; i++)
+		assert(v_append(vr, &(struct point){
+			.x = (double)i, .label = rand() % 100 - 50}));
+	assert(v_radix_sort(vr, label_key, NULL));
+	for (i = 1; i < SORTN; i++)
+	{
+		struct point *a = v_at(vr, i-1), *b = v_at(vr, i);
+		assert(a->label < b->label ||
+		       (a->label == b->label && a->x < b->x));
+	}
+	v_free(vr);
+
+	char *words[] = {"pear", "apple", "", "apricot", "applesauce", "apples"},
+	     *sorted_words[] = {"", "apple", "apples", "applesauce", "apricot", "pear"};
+	vr = v_new();
+	for (i = 0; i < ARRAY_LEN(words); i++)
+		assert(v_append(vr, words[i]));
+	assert(v_radix_sort(vr, v_radix_str_prefix, NULL));
+	for (i = 0; i < ARRAY_LEN(words); i++)
+		assert(strcmp(v_at(vr, i), sorted_words[i]) == 0);
+	v_free(vr);
+
+	/* a queue whose ring wraps around the array as it grows */
+	vector *q = v_new_sized(sizeof(int));
+	int in = 0, out = 0;
+	for (i = 0; i < 20000; i++)
+	{
+		if (i % 3 != 2)
+		{
+			assert(v_append(q, &in));
+			in++;
+		}
+		else
+			assert(*(int*)v_remove_first(q) == out++);
+		/* put back the one before the front now and then */
+		if (i % 1000 == 0)
+		{
+			out--;
+			assert(v_prepend(q, &out));
+		}
+	}
+	assert((int)v_length(q) == in - out);
+	for (i = 0; i < v_length(q); i++)
+		assert(*(int*)v_at(q, i) == out + (int)i);
+	/* and in the middle, near either end */
+	assert(v_insert(q, 1, &in));
+	assert(*(int*)v_remove(q, 1) == in);
+	assert(v_insert(q, v_length(q) - 1, &in));
+	assert(*(int*)v_remove(q, v_length(q) - 2) == in);
+	/* sorting is fine with the ring wrapped */
+	assert(v_reverse(q) && v_sort(q, cmpint, NULL));
+	for (i = 0; i < v_length(q); i++)
+		assert(*(int*)v_at(q, i) == out + (int)i);
+	v_free(q);
+
+	/* destructors see the elements in place */
+	v_dtor(vpt, count_labels, &pt.label);
+	pt.label = 0;
+	for (i = 0; i < 5; i++)
+		v_append(vpt, &(struct point){.label = (int)i});
+	v_set_length(vpt, 2);
+	assert(pt.label == 2+3+4);
+	v_free(vpt);
+	assert(pt.label == 2+3+4+0+1);
+
 #ifdef HAVE_BOEHM_GC
 	CHECK_LEAKS();
 #endif